@@ -0,0 +1,352 @@
+/** @file unit_test_bench.c
+ *  @brief Measures the framework's own overhead: passing and failing checks,
+ *      registration, startup, dispatch per test with and without resource
+ *      accounting, and Lua file loading.
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ *
+ *  Each benchmark runs in a fresh child process, since run_all_tests can only
+ *  run once per process, from an empty scratch directory so no stray Lua files
+ *  are picked up. Every benchmark runs several times and reports its best and
+ *  median cost per operation. The output has one line per benchmark with
+ *  stable names, so runs of different commits can be diffed or joined.
+ *
+ *  usage: unit_test_bench [--runs N] [name...]
+ */
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+    #define _XOPEN_SOURCE 700 /* fork and mkdtemp under -std=c89 */
+#endif
+#include "unit_test.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants
+ */
+enum {
+    DEFAULT_RUNS = 5,
+    MAX_RUNS = 64,
+    CHECK_COUNT = 10000000,
+    FAIL_COUNT = 200000,
+    TEST_COUNT = 4000,
+    LUA_CHECK_COUNT = 1000000,
+    LUA_FILE_COUNT = 200,
+    LUA_TESTS_PER_FILE = 10
+};
+
+typedef struct {
+    uint64_t    ns;     /**< Time for all operations */
+    uint64_t    ops;
+} bench_result_t;
+
+typedef void (bench_func_t)(bench_result_t* result);
+
+typedef struct {
+    const char*     name;
+    const char*     op;     /**< What one operation is */
+    bench_func_t*   func;
+} bench_t;
+
+/* Variables
+ */
+static char _test_names[TEST_COUNT][16];
+static uint64_t _dispatch_start = 0;
+static uint64_t _dispatch_end = 0;
+
+/* Internal functions
+ */
+static void _empty_test(void)
+{
+}
+/* Tests registered around the measured ones, so the time between them
+ * leaves out the fixed cost of run_all_tests that startup measures
+ */
+static void _mark_start(void)
+{
+    _dispatch_start = ut_now_ns();
+}
+static void _mark_end(void)
+{
+    _dispatch_end = ut_now_ns();
+}
+static void _failing_test(void)
+{
+    int ii;
+    for(ii=0; ii<FAIL_COUNT; ++ii)
+        CHECK_EQUAL(ii, ii+1);
+}
+static void _register_tests(int count)
+{
+    int ii;
+    _register_test(&_mark_start, "MarkStart", __FILE__);
+    for(ii=0; ii<count; ++ii) {
+        sprintf(_test_names[ii], "Empty%d", ii);
+        _register_test(&_empty_test, _test_names[ii], __FILE__);
+    }
+    _register_test(&_mark_end, "MarkEnd", __FILE__);
+}
+static void _run(const char* reporter, const char* option)
+{
+    const char* argv[] = {"unit_test_bench", NULL, NULL, NULL};
+    int argc = 1;
+    if(reporter) {
+        argv[argc++] = "--reporter";
+        argv[argc++] = reporter;
+    }
+    if(option)
+        argv[argc++] = option;
+    run_all_tests(argc, argv);
+}
+/* Returns the time from the _mark_start test to the _mark_end test, or to
+ * the end of the run when there is none, as Lua tests run after C tests
+ */
+static uint64_t _time_run(const char* reporter, const char* option)
+{
+    _dispatch_start = _dispatch_end = 0;
+    _run(reporter, option);
+    if(_dispatch_end == 0)
+        _dispatch_end = ut_now_ns();
+    return _dispatch_end - _dispatch_start;
+}
+
+/* Benchmarks
+ */
+static void _bench_check_pass_int(bench_result_t* result)
+{
+    uint64_t start = ut_now_ns();
+    int ii;
+    for(ii=0; ii<CHECK_COUNT; ++ii)
+        CHECK_EQUAL(ii, ii);
+    result->ns = ut_now_ns() - start;
+    result->ops = CHECK_COUNT;
+}
+static void _bench_check_pass_string(bench_result_t* result)
+{
+    uint64_t start = ut_now_ns();
+    int ii;
+    for(ii=0; ii<CHECK_COUNT; ++ii)
+        CHECK_EQUAL_STRING("unit_test", "unit_test");
+    result->ns = ut_now_ns() - start;
+    result->ops = CHECK_COUNT;
+}
+static void _bench_check_fail(bench_result_t* result)
+{
+    _register_test(&_mark_start, "MarkStart", __FILE__);
+    _register_test(&_failing_test, "Failing", __FILE__);
+    _register_test(&_mark_end, "MarkEnd", __FILE__);
+    result->ns = _time_run("none", NULL);
+    result->ops = FAIL_COUNT;
+}
+static void _bench_check_fail_console(bench_result_t* result)
+{
+    _register_test(&_mark_start, "MarkStart", __FILE__);
+    _register_test(&_failing_test, "Failing", __FILE__);
+    _register_test(&_mark_end, "MarkEnd", __FILE__);
+    result->ns = _time_run(NULL, NULL);
+    result->ops = FAIL_COUNT;
+}
+static void _bench_register(bench_result_t* result)
+{
+    uint64_t start;
+    int ii;
+    for(ii=0; ii<TEST_COUNT; ++ii)
+        sprintf(_test_names[ii], "Empty%d", ii);
+    start = ut_now_ns();
+    for(ii=0; ii<TEST_COUNT; ++ii)
+        _register_test(&_empty_test, _test_names[ii], __FILE__);
+    result->ns = ut_now_ns() - start;
+    result->ops = TEST_COUNT;
+}
+static void _bench_startup(bench_result_t* result)
+{
+    uint64_t start = ut_now_ns();
+    _run("none", NULL);
+    result->ns = ut_now_ns() - start;
+    result->ops = 1;
+}
+static void _bench_dispatch(bench_result_t* result)
+{
+    _register_tests(TEST_COUNT);
+    result->ns = _time_run("none", NULL);
+    result->ops = TEST_COUNT;
+}
+static void _bench_dispatch_usage(bench_result_t* result)
+{
+    _register_tests(TEST_COUNT);
+    result->ns = _time_run("none", "--usage");
+    result->ops = TEST_COUNT;
+}
+static void _bench_dispatch_console(bench_result_t* result)
+{
+    _register_tests(TEST_COUNT);
+    result->ns = _time_run(NULL, NULL);
+    result->ops = TEST_COUNT;
+}
+#if LUA_TESTS
+static void _write_file(const char* path, const char* text)
+{
+    FILE* file = fopen(path, "w");
+    if(file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fputs(text, file);
+    fclose(file);
+}
+static void _bench_lua_check_pass(bench_result_t* result)
+{
+    char script[128];
+    sprintf(script, "function Checks_Test()\n  for i=1,%d do CHECK_EQUAL(i, i) end\nend\n", LUA_CHECK_COUNT);
+    _write_file("bench_test.lua", script);
+    _register_test(&_mark_start, "MarkStart", __FILE__);
+    result->ns = _time_run("none", NULL);
+    result->ops = LUA_CHECK_COUNT;
+}
+static void _bench_lua_load(bench_result_t* result)
+{
+    char path[64];
+    char script[LUA_TESTS_PER_FILE * 32];
+    int ii;
+    int jj;
+    for(ii=0; ii<LUA_FILE_COUNT; ++ii) {
+        script[0] = '\0';
+        for(jj=0; jj<LUA_TESTS_PER_FILE; ++jj)
+            sprintf(script + strlen(script), "function T%d_Test() end\n", jj);
+        sprintf(path, "bench_%d_test.lua", ii);
+        _write_file(path, script);
+    }
+    _register_test(&_mark_start, "MarkStart", __FILE__);
+    result->ns = _time_run("none", NULL);
+    result->ops = LUA_FILE_COUNT;
+}
+#endif /* LUA_TESTS */
+
+static const bench_t _benchmarks[] = {
+    {"check_pass_int", "check", &_bench_check_pass_int},
+    {"check_pass_string", "check", &_bench_check_pass_string},
+    {"check_fail", "failure", &_bench_check_fail},
+    {"check_fail_console", "failure", &_bench_check_fail_console},
+    {"register", "test", &_bench_register},
+    {"startup", "run", &_bench_startup},
+    {"dispatch", "test", &_bench_dispatch},
+    {"dispatch_usage", "test", &_bench_dispatch_usage},
+    {"dispatch_console", "test", &_bench_dispatch_console},
+#if LUA_TESTS
+    {"lua_check_pass", "check", &_bench_lua_check_pass},
+    {"lua_load", "file", &_bench_lua_load},
+#endif
+    {NULL, NULL, NULL}
+};
+
+/* Removes a scratch directory and the files the benchmarks write there */
+static void _remove_scratch(const char* dir)
+{
+    char path[64];
+    int ii;
+    sprintf(path, "%s/bench_test.lua", dir);
+    unlink(path);
+    for(ii=0; ii<LUA_FILE_COUNT; ++ii) {
+        sprintf(path, "%s/bench_%d_test.lua", dir, ii);
+        unlink(path);
+    }
+    if(rmdir(dir) != 0)
+        perror(dir);
+}
+/* Runs one benchmark in a child process inside its own scratch directory
+ */
+static int _run_once(const bench_t* bench, bench_result_t* result)
+{
+    char dir[] = "/tmp/ut_bench_XXXXXX";
+    int fds[2];
+    int status = 0;
+    int null_fd;
+    pid_t pid;
+    if(mkdtemp(dir) == NULL || pipe(fds) != 0) {
+        perror("unit_test_bench");
+        return -1;
+    }
+    pid = fork();
+    if(pid == 0) {
+        close(fds[0]);
+        /* Reporter output is part of the cost but not of the results */
+        null_fd = open("/dev/null", O_WRONLY);
+        if(null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0 || chdir(dir) != 0)
+            _exit(1);
+        bench->func(result);
+        _exit(write(fds[1], result, sizeof(*result)) == (ssize_t)sizeof(*result) ? 0 : 1);
+    }
+    close(fds[1]);
+    memset(result, 0, sizeof(*result));
+    if(pid < 0 || read(fds[0], result, sizeof(*result)) != (ssize_t)sizeof(*result))
+        result->ops = 0;
+    close(fds[0]);
+    if(pid > 0)
+        waitpid(pid, &status, 0);
+    _remove_scratch(dir);
+    return result->ops ? 0 : -1;
+}
+static int _compare_double(const void* a, const void* b)
+{
+    double left = *(const double*)a;
+    double right = *(const double*)b;
+    return (left > right) - (left < right);
+}
+static int _is_selected(const char* name, int argc, const char* argv[])
+{
+    int selected = 1;
+    int ii;
+    for(ii=1; ii<argc; ++ii) {
+        if(strcmp(argv[ii], "--runs") == 0) {
+            ++ii;
+            continue;
+        }
+        if(strcmp(argv[ii], name) == 0)
+            return 1;
+        selected = 0;
+    }
+    return selected;
+}
+
+/* External functions
+ */
+int main(int argc, const char* argv[])
+{
+    double per_op[MAX_RUNS];
+    bench_result_t result;
+    const bench_t* bench = NULL;
+    int runs = DEFAULT_RUNS;
+    int failed = 0;
+    int ii;
+
+    for(ii=1; ii<argc-1; ++ii)
+        if(strcmp(argv[ii], "--runs") == 0)
+            runs = atoi(argv[ii+1]);
+    if(runs < 1)
+        runs = 1;
+    if(runs > MAX_RUNS)
+        runs = MAX_RUNS;
+
+    printf("# unit_test benchmarks: ns per op, best and median of %d runs\n", runs);
+    printf("# %-20s %12s %12s %10s  %s\n", "benchmark", "best", "median", "ops", "op");
+    for(bench = _benchmarks; bench->name; ++bench) {
+        if(!_is_selected(bench->name, argc, argv))
+            continue;
+        for(ii=0; ii<runs; ++ii) {
+            if(_run_once(bench, &result) != 0)
+                break;
+            per_op[ii] = (double)result.ns / (double)result.ops;
+        }
+        if(ii < runs) {
+            printf("  %-20s %12s\n", bench->name, "failed");
+            failed = 1;
+            continue;
+        }
+        qsort(per_op, (size_t)runs, sizeof(per_op[0]), &_compare_double);
+        printf("  %-20s %12.1f %12.1f %10lu  %s\n", bench->name, per_op[0], per_op[runs/2],
+               (unsigned long)result.ops, bench->op);
+        fflush(stdout);
+    }
+    return failed;
+}
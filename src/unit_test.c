@@ -1,14 +1,24 @@
 /** @file unit_test.c
  *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
  */
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+    #define _XOPEN_SOURCE 700 /* POSIX and snprintf under -std=c89 */
+    #define _DEFAULT_SOURCE
+    #define _DARWIN_C_SOURCE
+#endif
 #include "unit_test.h"
+#include "unit_test_journal.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <time.h>
 #include <dirent.h>
 #include <math.h>
+#include <ctype.h>
+#include <limits.h>
+#include <signal.h>
 #if LUA_TESTS
     #ifdef __cplusplus
         #include <lua.hpp>
@@ -21,15 +31,49 @@
 #ifndef _WIN32
     #include <unistd.h>
     #include <inttypes.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/resource.h>
+    #include <pthread.h>
+    #include <sched.h>
+    #include <poll.h>
+    #include <errno.h>
+    #include <sys/wait.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #ifdef __linux__
+        #include <sys/inotify.h>
+        #include <sys/epoll.h>
+    #endif
 #else
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
     #include <direct.h>
+    #include <io.h>
     #define snprintf sprintf_s
     #define getcwd _getcwd
     #define vsnprintf(buff, count, format, args) vsnprintf_s(buff, count, count, format, args)
 #endif
 
+#ifndef _WIN32
+    #define vformat_length(format, args) vsnprintf(NULL, 0, format, args)
+#else
+    #define vformat_length(format, args) _vscprintf(format, args)
+#endif
+
+/* Only Windows builds go without inttypes.h, where 64-bit is long long */
 #ifndef PRId64
-    #define PRId64 "ld"
+    #define PRId64 "I64d"
+#endif
+#ifndef PRIu64
+    #define PRIu64 "I64u"
+#endif
+
+#ifdef _MSC_VER
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL __thread
 #endif
 
 #if defined(__APPLE__) || defined(__GNUG__)
@@ -41,6 +85,28 @@
 /* Constants
  */
 enum {MAX_TESTS = 4096};
+enum {
+    OUTPUT_FLUSH_SIZE = 64*1024,
+    DOTS_PER_LINE = 60
+};
+enum { WATCH_SETTLE_MS = 50 };
+enum { REPEAT_CHUNK = 256 };
+enum { TEST_TIMEOUT_MS = 10000 };
+enum {
+    USAGE_OUTLIER_FACTOR = 4,
+    USAGE_MAX_OUTLIERS = 10
+};
+enum {
+    ARENA_BLOCK_SIZE = 64*1024,
+    ARENA_ALIGNMENT = 16,
+    ARENA_POISON = 0xdd
+};
+enum {
+    SNAPSHOT_MAX_DIFF_LINES = 8,
+    SNAPSHOT_MAX_LINE_WIDTH = 120,
+    SNAPSHOT_CONTEXT_LINES = 2,
+    SNAPSHOT_HEX_WINDOW = 16
+};
 static const float EPSILON = 0.0001f;
 
 typedef enum {
@@ -51,207 +117,3474 @@ typedef enum {
 
 /* Variables
  */
-static test_func_t* _test_funcs[MAX_TESTS] = {NULL};
+typedef struct {
+    test_func_t*        func;
+    const char*         name;
+    const char*         file;
+    int                 selected;
+    async_test_func_t*  async_func; /**< Set instead of func for ASYNC_TEST */
+    int                 line;       /**< Where an ASYNC_TEST is defined */
+} test_entry_t;
+
+static test_entry_t _tests[MAX_TESTS];
 static int  _num_tests = 0;
 static int  _num_tests_passed = 0;
 static int  _num_tests_failed = 0;
 static int  _num_tests_ignored = 0;
-static test_result_t _current_result = kResultPass;
+static int  _update_snapshots = 0;
+static uint32_t _seed = 0;
+static int  _test_timeout_ms = TEST_TIMEOUT_MS;
 
-#if LUA_TESTS
-static struct lua_State*    _L = NULL;
-static char _current_lua_test_file[1024];
+/* Threading
+ */
+#ifndef _WIN32
+    typedef pthread_mutex_t mutex_t;
+    typedef pthread_cond_t  cond_t;
+    typedef pthread_t       thread_t;
+    typedef void* (thread_func_t)(void*);
+    #define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+    #define THREAD_FUNC(name, arg) void* name(void* arg)
+    #define THREAD_RETURN NULL
+#else
+    typedef SRWLOCK             mutex_t;
+    typedef CONDITION_VARIABLE  cond_t;
+    typedef HANDLE              thread_t;
+    typedef DWORD (WINAPI thread_func_t)(LPVOID);
+    #define MUTEX_INITIALIZER SRWLOCK_INIT
+    #define THREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+    #define THREAD_RETURN 0
+#endif
 
-/* Internal functions
+static void _mutex_init(mutex_t* mutex)
+{
+#ifndef _WIN32
+    pthread_mutex_init(mutex, NULL);
+#else
+    InitializeSRWLock(mutex);
+#endif
+}
+static void _mutex_destroy(mutex_t* mutex)
+{
+#ifndef _WIN32
+    pthread_mutex_destroy(mutex);
+#else
+    (void)sizeof(mutex);
+#endif
+}
+static void _mutex_lock(mutex_t* mutex)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(mutex);
+#else
+    AcquireSRWLockExclusive(mutex);
+#endif
+}
+static void _mutex_unlock(mutex_t* mutex)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(mutex);
+#else
+    ReleaseSRWLockExclusive(mutex);
+#endif
+}
+static void _cond_init(cond_t* cond)
+{
+#ifndef _WIN32
+    pthread_cond_init(cond, NULL);
+#else
+    InitializeConditionVariable(cond);
+#endif
+}
+static void _cond_destroy(cond_t* cond)
+{
+#ifndef _WIN32
+    pthread_cond_destroy(cond);
+#else
+    (void)sizeof(cond);
+#endif
+}
+static void _cond_wait(cond_t* cond, mutex_t* mutex)
+{
+#ifndef _WIN32
+    pthread_cond_wait(cond, mutex);
+#else
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+#endif
+}
+static void _cond_broadcast(cond_t* cond)
+{
+#ifndef _WIN32
+    pthread_cond_broadcast(cond);
+#else
+    WakeAllConditionVariable(cond);
+#endif
+}
+static int _thread_create(thread_t* thread, thread_func_t* func, void* arg)
+{
+#ifndef _WIN32
+    return pthread_create(thread, NULL, func, arg);
+#else
+    *thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+    return *thread == NULL;
+#endif
+}
+static void _thread_join(thread_t thread)
+{
+#ifndef _WIN32
+    pthread_join(thread, NULL);
+#else
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#endif
+}
+static void _thread_yield(void)
+{
+#ifndef _WIN32
+    sched_yield();
+#else
+    SwitchToThread();
+#endif
+}
+
+/* Test contexts
+ *  Checks report into the context of the test that owns the calling thread.
+ *  Threads the framework starts on behalf of a test (ut_stress) inherit it
+ *  explicitly; any other thread reports into the active context, that of the
+ *  test that last ran code. When repeats run in parallel there is no single
+ *  such test, so those checks land in the stray context and fail the run.
  */
-static const char* _get_ext(const char* filename)
+typedef struct {
+    int64_t     user_ns;
+    int64_t     system_ns;
+    int64_t     max_rss_bytes;  /**< Peak resident set */
+    int64_t     rss_bytes;      /**< Resident set, or the peak where unavailable */
+    int64_t     minor_faults;
+    int64_t     major_faults;
+    int64_t     voluntary_switches;
+    int64_t     involuntary_switches;
+    int64_t     thread_cpu_ns;  /**< CPU time of the sampling thread where known, else user + system */
+} usage_t;
+
+typedef struct {
+    const char*     name;
+    test_result_t   result;
+    int             num_failures;
+    const char*     failure_file;
+    int             failure_line;
+    uint32_t        seed;
+    int*            failure_gate;   /**< Shared by contexts where only the first to fail reports */
+    int             muted;
+    const usage_t*  usage_start;    /**< Sampled as the test started, or NULL if not measured */
+    const usage_t*  usage;          /**< What the finished test used, or NULL */
+    ut_failure_func_t* failure_hook;    /**< Takes failures instead of the reporter */
+    void*           failure_data;
+} test_context_t;
+
+static test_context_t   _main_context = {NULL, kResultPass, 0, NULL, 0, 0, NULL, 0, NULL, NULL, NULL, NULL};
+static test_context_t   _stray_context = {"a thread a test started", kResultPass, 0, NULL, 0, 0, NULL, 0, NULL, NULL, NULL, NULL};
+static test_context_t* volatile _active_context = &_main_context;
+static THREAD_LOCAL test_context_t* _thread_context = NULL;
+static mutex_t          _output_lock = MUTEX_INITIALIZER;
+
+static test_context_t* _current_context(void)
 {
-    const char* end = filename + strlen(filename);
-    while(end && *end != '.' && end > filename)
-        end--;
-    if(end == filename)
-        return NULL;
-    if(*end == '.')
-        end++;
-    return end;
+    test_context_t* active = _active_context;
+    if(_thread_context)
+        return _thread_context;
+    return active ? active : &_stray_context;
 }
-static int _lua_line(lua_State* L)
+/* Runs the calling thread in context, which also becomes the active one
+ * unless that is ambiguous. Returns the thread's previous context.
+ */
+static test_context_t* _enter_context(test_context_t* context)
 {
-    lua_Debug ar;
-    lua_getstack(L, 1, &ar);
-    lua_getinfo(L, "nSl", &ar);
-    return ar.currentline;
+    test_context_t* previous = _thread_context;
+    _thread_context = context;
+    if(_active_context)
+        _active_context = context;
+    return previous;
 }
-static int _FAIL_l(lua_State* L)
+/* Called as a scheduled test finishes, before its context goes away */
+static void _leave_active_context(const test_context_t* context, test_context_t* outer)
 {
-    _fail(_current_lua_test_file, _lua_line(L), lua_tostring(L, 1));
-    return 0;
+    if(_active_context == context)
+        _active_context = outer;
+}
+static void _reset_context(test_context_t* context)
+{
+    context->result = kResultPass;
+    context->num_failures = 0;
+    context->failure_file = NULL;
+    context->failure_line = 0;
+    context->muted = 0;
+    context->usage_start = NULL;
+    context->usage = NULL;
+    context->failure_hook = NULL;
+    context->failure_data = NULL;
 }
 
-static int _check_true_l(lua_State* L)
+/* Output functions
+ *  All output goes through one buffer that is flushed to stdout in large
+ *  writes. Reporters decide what gets formatted into it; the output lock
+ *  must be held while calling them.
+ */
+typedef struct {
+    char*   data;
+    size_t  size;
+    size_t  capacity;
+} buffer_t;
+
+typedef struct {
+    const char* name;
+    const char* file;               /**< Tells apart tests with the same name */
+    int         iterations;
+    int         failures;
+    int         ignored;
+    int         first_failure;      /**< Lowest failing iteration, or -1 */
+    uint32_t    first_failure_seed;
+    const char* failure_file;
+    int         failure_line;
+    double      sum_ns;
+    double      sum_squares_ns;
+    uint64_t    min_ns;
+    uint64_t    max_ns;
+} repeat_stats_t;
+
+typedef struct {
+    void (*begin_run)(void);
+    void (*test_finished)(const test_context_t* context, uint64_t duration);
+    void (*test_repeated)(const repeat_stats_t* stats);
+    void (*failure)(const test_context_t* context, const char* file, int line, const char* message);
+    void (*note)(const char* text);
+    void (*end_run)(int failed, int passed, int ignored, int total);
+} reporter_t;
+
+static buffer_t _output = {NULL, 0, 0};
+static FILE*    _output_file = NULL;    /**< stdout unless --driver moved it */
+static int      _output_terminal = 0;   /**< Someone watches the progress live */
+static int      _output_column = 0;
+static int      _output_midline = 0;
+static int      _quiet = 0;
+
+static int _buffer_reserve(buffer_t* buffer, size_t size)
 {
-    _check_true(_current_lua_test_file, _lua_line(L), lua_toboolean(L, 1));
-    return 0;
+    size_t capacity = buffer->capacity ? buffer->capacity : 256;
+    char* data = NULL;
+    if(buffer->size + size < buffer->capacity)
+        return 1;
+    while(capacity <= buffer->size + size)
+        capacity *= 2;
+    data = (char*)realloc(buffer->data, capacity);
+    if(data == NULL)
+        return 0;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 1;
 }
-static int _check_false_l(lua_State* L)
+static void _buffer_append(buffer_t* buffer, const char* data, size_t size)
 {
-    _check_false(_current_lua_test_file, _lua_line(L), lua_toboolean(L, 1));
-    return 0;
+    if(!_buffer_reserve(buffer, size))
+        return;
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    buffer->data[buffer->size] = '\0';
+}
+static void _buffer_puts(buffer_t* buffer, const char* str)
+{
+    _buffer_append(buffer, str, strlen(str));
+}
+static void _buffer_vprintf(buffer_t* buffer, int length, const char* format, va_list args)
+{
+    if(length < 0 || !_buffer_reserve(buffer, (size_t)length))
+        return;
+    vsnprintf(buffer->data + buffer->size, (size_t)length + 1, format, args);
+    buffer->size += (size_t)length;
+}
+static void _buffer_printf(buffer_t* buffer, const char* format, ...)
+{
+    va_list args;
+    int length;
+    va_start(args, format);
+    length = vformat_length(format, args);
+    va_end(args);
+    va_start(args, format);
+    _buffer_vprintf(buffer, length, format, args);
+    va_end(args);
+}
+static void _buffer_put_json(buffer_t* buffer, const char* str)
+{
+    const char* run = str;
+    _buffer_append(buffer, "\"", 1);
+    for(; str && *str; ++str) {
+        unsigned char c = (unsigned char)*str;
+        if(c != '"' && c != '\\' && c >= 0x20)
+            continue;
+        _buffer_append(buffer, run, (size_t)(str - run));
+        if(c == '"' || c == '\\')
+            _buffer_printf(buffer, "\\%c", c);
+        else if(c == '\n')
+            _buffer_puts(buffer, "\\n");
+        else
+            _buffer_printf(buffer, "\\u%04x", (unsigned int)c);
+        run = str + 1;
+    }
+    if(run)
+        _buffer_append(buffer, run, (size_t)(str - run));
+    _buffer_append(buffer, "\"", 1);
+}
+static void _buffer_free(buffer_t* buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = buffer->capacity = 0;
+}
+static void _buffer_put_duration(buffer_t* buffer, double ns)
+{
+    if(ns < 1e3)
+        _buffer_printf(buffer, "%.0fns", ns);
+    else if(ns < 1e6)
+        _buffer_printf(buffer, "%.1fus", ns / 1e3);
+    else if(ns < 1e9)
+        _buffer_printf(buffer, "%.1fms", ns / 1e6);
+    else
+        _buffer_printf(buffer, "%.2fs", ns / 1e9);
+}
+static void _output_flush(void)
+{
+    FILE* file = _output_file ? _output_file : stdout;
+    if(_output.size)
+        fwrite(_output.data, 1, _output.size, file);
+    fflush(file);
+    _output.size = 0;
+}
+static void _output_check_flush(void)
+{
+    if(_output.size >= OUTPUT_FLUSH_SIZE)
+        _output_flush();
 }
 
-static int _check_equal_l(lua_State* L)
+static double _repeat_mean_ns(const repeat_stats_t* stats)
 {
-    _check_equal(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
-    return 0;
+    return stats->iterations ? stats->sum_ns / stats->iterations : 0.0;
 }
-static int _check_not_equal_l(lua_State* L)
+static double _repeat_stddev_ns(const repeat_stats_t* stats)
 {
-    _check_not_equal(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
-    return 0;
+    double mean = _repeat_mean_ns(stats);
+    double variance;
+    if(stats->iterations < 2)
+        return 0.0;
+    variance = (stats->sum_squares_ns - mean * stats->sum_ns) / (stats->iterations - 1);
+    return variance > 0.0 ? sqrt(variance) : 0.0;
 }
-static int _check_less_than_l(lua_State* L)
+
+/* console reporter */
+static void _console_begin_run(void)
 {
-    _check_less_than(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
-    return 0;
+    _output_column = 0;
+#ifndef _WIN32
+    _output_terminal = isatty(STDOUT_FILENO);
+#else
+    _output_terminal = _isatty(_fileno(stdout));
+#endif
+    if(!_quiet) {
+        _buffer_puts(&_output, "------------------------------------------------------------");
+        _output_midline = 1;
+    }
 }
-static int _check_greater_than_l(lua_State* L)
+static void _console_test_finished(const test_context_t* context, uint64_t duration)
 {
-    _check_greater_than(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
-    return 0;
+    char mark = context->result == kResultPass ? '.' : '!';
+    if(_quiet)
+        return;
+    if(_output_column++ % DOTS_PER_LINE == 0)
+        _buffer_append(&_output, "\n", 1);
+    if(context->result != kResultFail)
+        _buffer_append(&_output, &mark, 1);
+    _output_midline = 1;
+    /* A terminal shows progress as it happens; pipes and files get batches */
+    if(_output_terminal)
+        _output_flush();
+    else
+        _output_check_flush();
+    (void)sizeof(duration);
 }
-static int _check_less_than_equal_l(lua_State* L)
+static void _console_test_repeated(const repeat_stats_t* stats)
 {
-    _check_less_than_equal(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
-    return 0;
+    if(_quiet && stats->failures == 0)
+        return;
+    if(_output_midline)
+        _buffer_append(&_output, "\n", 1);
+    _buffer_printf(&_output, "%s (%s): %d/%d failed (%.2f%%)  mean ", stats->name, stats->file, stats->failures,
+                   stats->iterations, stats->iterations ? 100.0 * stats->failures / stats->iterations : 0.0);
+    _buffer_put_duration(&_output, _repeat_mean_ns(stats));
+    _buffer_puts(&_output, "  sd ");
+    _buffer_put_duration(&_output, _repeat_stddev_ns(stats));
+    _buffer_puts(&_output, "  min ");
+    _buffer_put_duration(&_output, (double)stats->min_ns);
+    _buffer_puts(&_output, "  max ");
+    _buffer_put_duration(&_output, (double)stats->max_ns);
+    _buffer_append(&_output, "\n", 1);
+    if(stats->first_failure >= 0)
+        _buffer_printf(&_output, "  first failure: iteration %d, seed %lu, at %s:%d\n",
+                       stats->first_failure+1, (unsigned long)stats->first_failure_seed,
+                       stats->failure_file ? stats->failure_file : "?", stats->failure_line);
+    _output_midline = 0;
+    _output_check_flush();
 }
-static int _check_greater_than_equal_l(lua_State* L)
+static void _console_failure(const test_context_t* context, const char* file, int line, const char* message)
 {
-    _check_greater_than_equal(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
-    return 0;
+    _buffer_printf(&_output, "%s"ERROR_FORMAT, _quiet ? "" : "\n", file, line);
+    _buffer_puts(&_output, message);
+    _buffer_append(&_output, "\n", 1);
+    _output_midline = 0;
+    _output_flush();
+    (void)sizeof(context);
+}
+static void _console_note(const char* text)
+{
+    if(_output_midline)
+        _buffer_append(&_output, "\n", 1);
+    _buffer_puts(&_output, text);
+    _output_midline = 0;
+    _output_check_flush();
+}
+static void _console_end_run(int failed, int passed, int ignored, int total)
+{
+    if(_quiet && failed == 0)
+        return;
+    if(!_quiet)
+        _buffer_puts(&_output, "\n------------------------------------------------------------\n");
+    _buffer_printf(&_output, "%d failed, %d passed, %d ignored, %d total\n", failed, passed, ignored, total);
 }
 
-static int _check_null_l(lua_State* L)
+/* JSON lines reporter */
+static void _json_begin_run(void)
 {
-    _check_null(_current_lua_test_file, _lua_line(L), lua_topointer(L, 1));
+    _buffer_puts(&_output, "{\"event\":\"begin\"}\n");
+}
+static void _json_test_finished(const test_context_t* context, uint64_t duration)
+{
+    static const char* results[] = { "pass", "fail", "ignore" };
+    _buffer_puts(&_output, "{\"event\":\"test\",\"name\":");
+    _buffer_put_json(&_output, context->name);
+    _buffer_printf(&_output, ",\"status\":\"%s\",\"duration_ns\":%"PRIu64,
+                   results[context->result], duration);
+    if(context->usage) {
+        const usage_t* usage = context->usage;
+        _buffer_printf(&_output, ",\"usage\":{\"user_ns\":%"PRId64",\"system_ns\":%"PRId64
+                       ",\"max_rss_growth\":%"PRId64",\"rss_growth\":%"PRId64,
+                       usage->user_ns, usage->system_ns, usage->max_rss_bytes, usage->rss_bytes);
+        _buffer_printf(&_output, ",\"minor_faults\":%"PRId64",\"major_faults\":%"PRId64
+                       ",\"voluntary_switches\":%"PRId64",\"involuntary_switches\":%"PRId64"}",
+                       usage->minor_faults, usage->major_faults, usage->voluntary_switches,
+                       usage->involuntary_switches);
+    }
+    _buffer_puts(&_output, "}\n");
+    _output_check_flush();
+}
+static void _json_test_repeated(const repeat_stats_t* stats)
+{
+    _buffer_puts(&_output, "{\"event\":\"repeat\",\"name\":");
+    _buffer_put_json(&_output, stats->name);
+    _buffer_puts(&_output, ",\"file\":");
+    _buffer_put_json(&_output, stats->file);
+    _buffer_printf(&_output, ",\"iterations\":%d,\"failures\":%d,\"ignored\":%d,",
+                   stats->iterations, stats->failures, stats->ignored);
+    _buffer_printf(&_output, "\"mean_ns\":%.0f,\"stddev_ns\":%.0f,\"min_ns\":%"PRIu64",\"max_ns\":%"PRIu64,
+                   _repeat_mean_ns(stats), _repeat_stddev_ns(stats), stats->min_ns, stats->max_ns);
+    if(stats->first_failure >= 0) {
+        _buffer_printf(&_output, ",\"first_failure\":{\"iteration\":%d,\"seed\":%lu,\"file\":",
+                       stats->first_failure+1, (unsigned long)stats->first_failure_seed);
+        _buffer_put_json(&_output, stats->failure_file);
+        _buffer_printf(&_output, ",\"line\":%d}", stats->failure_line);
+    }
+    _buffer_puts(&_output, "}\n");
+    _output_check_flush();
+}
+static void _json_failure(const test_context_t* context, const char* file, int line, const char* message)
+{
+    _buffer_puts(&_output, "{\"event\":\"failure\",\"name\":");
+    _buffer_put_json(&_output, context->name);
+    _buffer_puts(&_output, ",\"file\":");
+    _buffer_put_json(&_output, file);
+    _buffer_printf(&_output, ",\"line\":%d,\"message\":", line);
+    _buffer_put_json(&_output, message);
+    _buffer_puts(&_output, "}\n");
+    _output_flush();
+}
+static void _json_note(const char* text)
+{
+    _buffer_puts(&_output, "{\"event\":\"note\",\"text\":");
+    _buffer_put_json(&_output, text);
+    _buffer_puts(&_output, "}\n");
+    _output_check_flush();
+}
+static void _json_end_run(int failed, int passed, int ignored, int total)
+{
+    _buffer_printf(&_output, "{\"event\":\"end\",\"failed\":%d,\"passed\":%d,\"ignored\":%d,\"total\":%d}\n",
+                   failed, passed, ignored, total);
+}
+
+/* silent reporter */
+static void _null_begin_run(void) {}
+static void _null_test_finished(const test_context_t* context, uint64_t duration)
+{
+    (void)sizeof(context);
+    (void)sizeof(duration);
+}
+static void _null_test_repeated(const repeat_stats_t* stats)
+{
+    (void)sizeof(stats);
+}
+static void _null_failure(const test_context_t* context, const char* file, int line, const char* message)
+{
+    (void)sizeof(context);
+    (void)sizeof(file);
+    (void)sizeof(line);
+    (void)sizeof(message);
+}
+static void _null_note(const char* text)
+{
+    (void)sizeof(text);
+}
+static void _null_end_run(int failed, int passed, int ignored, int total)
+{
+    (void)sizeof(failed);
+    (void)sizeof(passed);
+    (void)sizeof(ignored);
+    (void)sizeof(total);
+}
+
+static const reporter_t _console_reporter = {
+    _console_begin_run, _console_test_finished, _console_test_repeated, _console_failure, _console_note,
+    _console_end_run
+};
+static const reporter_t _json_reporter = {
+    _json_begin_run, _json_test_finished, _json_test_repeated, _json_failure, _json_note, _json_end_run
+};
+static const reporter_t _null_reporter = {
+    _null_begin_run, _null_test_finished, _null_test_repeated, _null_failure, _null_note, _null_end_run
+};
+static const reporter_t* _reporter = &_console_reporter;
+
+static const reporter_t* _find_reporter(const char* name)
+{
+    if(strcmp(name, "console") == 0)
+        return &_console_reporter;
+    if(strcmp(name, "json") == 0)
+        return &_json_reporter;
+    if(strcmp(name, "none") == 0)
+        return &_null_reporter;
+    return NULL;
+}
+static void _report_note(const char* format, ...)
+{
+    va_list args;
+    buffer_t text = {NULL, 0, 0};
+    int length;
+    va_start(args, format);
+    length = vformat_length(format, args);
+    va_end(args);
+    va_start(args, format);
+    _buffer_vprintf(&text, length, format, args);
+    va_end(args);
+    if(text.data == NULL)
+        return;
+    _mutex_lock(&_output_lock);
+    _reporter->note(text.data);
+    _mutex_unlock(&_output_lock);
+    _buffer_free(&text);
+}
+
+/* Journal functions
+ */
+static ut_journal_header_t* _journal = NULL;
+static size_t   _journal_size = 0;
+static int      _journal_fd = -1;
+
+static void _memory_barrier(void)
+{
+#if defined(__GNUC__)
+    __sync_synchronize();
+#elif defined(_MSC_VER)
+    MemoryBarrier();
+#endif
+}
+static ut_journal_record_t* _journal_at(int index)
+{
+    return (ut_journal_record_t*)(_journal + 1) + index;
+}
+static int _journal_map(uint32_t capacity)
+{
+#ifndef _WIN32
+    size_t size = sizeof(ut_journal_header_t) + (size_t)capacity * sizeof(ut_journal_record_t);
+    void* data = NULL;
+    if(ftruncate(_journal_fd, (off_t)size) != 0)
+        return -1;
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _journal_fd, 0);
+    if(data == MAP_FAILED)
+        return -1;
+    if(_journal)
+        munmap(_journal, _journal_size);
+    _journal = (ut_journal_header_t*)data;
+    _journal_size = size;
+    _journal->capacity = capacity;
     return 0;
+#else
+    (void)sizeof(capacity);
+    return -1;
+#endif
 }
-static int _check_not_null_l(lua_State* L)
+static void _journal_open(const char* path)
+{
+#ifndef _WIN32
+    _journal_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(_journal_fd < 0 || _journal_map(MAX_TESTS) != 0) {
+        perror("Could not create journal");
+        if(_journal_fd >= 0)
+            close(_journal_fd);
+        _journal_fd = -1;
+        return;
+    }
+    _journal->magic = UT_JOURNAL_MAGIC;
+    _journal->version = UT_JOURNAL_VERSION;
+    _journal->header_size = (uint32_t)sizeof(ut_journal_header_t);
+    _journal->record_size = (uint32_t)sizeof(ut_journal_record_t);
+    _journal->pid = (uint32_t)getpid();
+    _journal->start_time = (uint64_t)time(NULL);
+#else
+    printf("Journals are not supported on this platform: %s\n", path);
+#endif
+}
+static void _journal_close(void)
+{
+#ifndef _WIN32
+    if(_journal == NULL)
+        return;
+    _journal->num_failed = (uint32_t)_num_tests_failed;
+    _journal->num_passed = (uint32_t)_num_tests_passed;
+    _journal->num_ignored = (uint32_t)_num_tests_ignored;
+    _memory_barrier();
+    _journal->finished = 1;
+    msync(_journal, _journal_size, MS_ASYNC);
+    munmap(_journal, _journal_size);
+    close(_journal_fd);
+    _journal = NULL;
+    _journal_fd = -1;
+#endif
+}
+static int _journal_begin(const char* name)
+{
+    ut_journal_record_t* record = NULL;
+    if(_journal == NULL)
+        return -1;
+    if(_journal->count == _journal->capacity && _journal_map(_journal->capacity * 2) != 0)
+        return -1;
+    record = _journal_at((int)_journal->count);
+    memset(record, 0, sizeof(*record));
+    record->id = _journal->count;
+    record->status = kJournalRunning;
+    snprintf(record->name, sizeof(record->name), "%s", name ? name : "");
+    /* Publish the record only once its contents are visible to readers */
+    _memory_barrier();
+    return (int)_journal->count++;
+}
+static void _journal_end(int index, const test_context_t* context, uint64_t duration)
+{
+    ut_journal_record_t* record = NULL;
+    size_t length;
+    if(_journal == NULL || index < 0)
+        return;
+    record = _journal_at(index);
+    record->duration_ns = duration;
+    if(context->failure_file) {
+        /* Keep the end of long paths; it is the part that identifies the file */
+        length = strlen(context->failure_file);
+        if(length >= sizeof(record->file))
+            length = sizeof(record->file) - 1;
+        memcpy(record->file, context->failure_file + strlen(context->failure_file) - length, length);
+        record->file[length] = '\0';
+        record->line = context->failure_line;
+    }
+    _memory_barrier();
+    switch(context->result)
+    {
+    case kResultPass: record->status = kJournalPass; break;
+    case kResultFail: record->status = kJournalFail; break;
+    case kResultIgnore: record->status = kJournalIgnore; break;
+    }
+}
+
+/* Arena
+ *  Scratch memory for test bodies. Each thread running tests owns a chain of
+ *  blocks; allocation bumps through the current block and a reset rewinds to
+ *  the first block, keeping the chain for the next test.
+ */
+typedef struct arena_block_t {
+    struct arena_block_t*   next;
+    size_t                  size;   /**< Bytes of data following the header */
+} arena_block_t;
+
+typedef struct {
+    arena_block_t*  first;
+    arena_block_t*  current;
+    size_t          used;   /**< Bytes used in current */
+} arena_t;
+
+static THREAD_LOCAL arena_t _arena = {NULL, NULL, 0};
+static int  _poison_arena = 0;
+
+static char* _arena_data(arena_block_t* block)
+{
+    return (char*)(block + 1);
+}
+static arena_block_t* _arena_add_block(arena_t* arena, size_t min_size)
+{
+    arena_block_t* block = NULL;
+    size_t size = ARENA_BLOCK_SIZE;
+    if(arena->current && arena->current->size > size / 2)
+        size = arena->current->size * 2;
+    if(size < min_size)
+        size = min_size;
+    block = (arena_block_t*)malloc(sizeof(*block) + size);
+    if(block == NULL)
+        return NULL;
+    block->size = size;
+    /* Insert after the current block so a reset still reaches the rest */
+    if(arena->current) {
+        block->next = arena->current->next;
+        arena->current->next = block;
+    } else {
+        block->next = arena->first;
+        arena->first = block;
+    }
+    arena->current = block;
+    arena->used = 0;
+    if(_poison_arena)
+        memset(_arena_data(block), ARENA_POISON, size);
+    return block;
+}
+static void* _arena_alloc(arena_t* arena, size_t size, size_t alignment)
+{
+    arena_block_t* block = NULL;
+    uintptr_t data;
+    size_t offset;
+    for(;;) {
+        block = arena->current;
+        if(block) {
+            data = (uintptr_t)_arena_data(block);
+            offset = (size_t)(((data + arena->used + alignment - 1) & ~(uintptr_t)(alignment - 1)) - data);
+            if(offset <= block->size && size <= block->size - offset) {
+                arena->used = offset + size;
+                return _arena_data(block) + offset;
+            }
+            if(block->next && size + alignment <= block->next->size) {
+                arena->current = block->next;
+                arena->used = 0;
+                continue;
+            }
+        }
+        if(size > (size_t)-1 - alignment || _arena_add_block(arena, size + alignment) == NULL)
+            return NULL;
+    }
+}
+static void _arena_reset(arena_t* arena)
+{
+    arena_block_t* block = NULL;
+    if(_poison_arena) {
+        /* Only the blocks handed out since the last reset */
+        for(block = arena->first; block && block != arena->current; block = block->next)
+            memset(_arena_data(block), ARENA_POISON, block->size);
+        if(block)
+            memset(_arena_data(block), ARENA_POISON, arena->used);
+    }
+    arena->current = arena->first;
+    arena->used = 0;
+}
+static void _arena_free(arena_t* arena)
+{
+    arena_block_t* block = arena->first;
+    while(block) {
+        arena_block_t* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->used = 0;
+}
+
+/* Resource usage
+ *  Sampling is opt-in: with --usage or the JSON reporter, C tests run one at
+ *  a time are bracketed by getrusage and, on Linux, the resident set from
+ *  /proc/self/statm. Async, Lua and --repeat tests share the process with
+ *  other tests in flight, so they are not measured. JSON reports carry each
+ *  test's usage and --usage also lists the outliers at the end of the run.
+ *  Otherwise only tests that declare a budget are sampled, from their first
+ *  declaration on. --no-usage turns all of it off.
+ */
+typedef struct {
+    const char* name;
+    usage_t     usage;
+} usage_record_t;
+
+typedef struct {
+    const char* label;
+    size_t      offset;
+    int64_t     floor;  /**< Smaller values are never outliers */
+    int         kind;   /**< 0 count, 1 duration, 2 bytes */
+} usage_metric_t;
+
+static const usage_metric_t _usage_metrics[] = {
+    {"user cpu", offsetof(usage_t, user_ns), 5000000, 1},
+    {"system cpu", offsetof(usage_t, system_ns), 5000000, 1},
+    {"peak rss growth", offsetof(usage_t, max_rss_bytes), 1024*1024, 2},
+    {"rss growth", offsetof(usage_t, rss_bytes), 1024*1024, 2},
+    {"minor faults", offsetof(usage_t, minor_faults), 256, 0},
+    {"major faults", offsetof(usage_t, major_faults), 1, 0},
+    {"voluntary switches", offsetof(usage_t, voluntary_switches), 16, 0},
+    {"involuntary switches", offsetof(usage_t, involuntary_switches), 16, 0}
+};
+
+typedef struct {
+    const char* file;       /**< Where the budget was declared, NULL if none */
+    int         line;
+    int64_t     limit;
+} budget_t;
+
+static int              _measure_usage = 0;
+static int              _report_usage = 0;
+static int              _no_usage = 0;
+static usage_t          _test_usage_start;
+static int              _budgets_open = 0;
+static int              _budgets_sampled = 0;
+static usage_t          _budget_start;
+static budget_t         _rss_budget;
+static budget_t         _cpu_budget;
+static usage_t          _test_usage;
+static usage_record_t*  _usage_records = NULL;
+static int              _num_usage_records = 0;
+static int              _usage_capacity = 0;
+#ifdef __linux__
+static int              _statm_fd = -1;
+#endif
+
+static int64_t _resident_bytes(void)
+{
+#ifdef __linux__
+    char text[128];
+    long pages = 0;
+    long resident = 0;
+    ssize_t length;
+    if(_statm_fd < 0)
+        _statm_fd = open("/proc/self/statm", O_RDONLY);
+    if(_statm_fd >= 0 && (length = pread(_statm_fd, text, sizeof(text) - 1, 0)) > 0) {
+        text[length] = '\0';
+        if(sscanf(text, "%ld %ld", &pages, &resident) == 2)
+            return (int64_t)resident * (int64_t)sysconf(_SC_PAGESIZE);
+    }
+#endif
+    return -1;
+}
+static int _usage_sample(usage_t* usage)
+{
+#ifndef _WIN32
+    struct rusage resources;
+    if(getrusage(RUSAGE_SELF, &resources) != 0)
+        return -1;
+    usage->user_ns = (int64_t)resources.ru_utime.tv_sec * 1000000000 + (int64_t)resources.ru_utime.tv_usec * 1000;
+    usage->system_ns = (int64_t)resources.ru_stime.tv_sec * 1000000000 + (int64_t)resources.ru_stime.tv_usec * 1000;
+#ifdef __APPLE__
+    usage->max_rss_bytes = (int64_t)resources.ru_maxrss;
+#else
+    usage->max_rss_bytes = (int64_t)resources.ru_maxrss * 1024;
+#endif
+    usage->rss_bytes = _resident_bytes();
+    if(usage->rss_bytes < 0)
+        usage->rss_bytes = usage->max_rss_bytes;
+    usage->minor_faults = (int64_t)resources.ru_minflt;
+    usage->major_faults = (int64_t)resources.ru_majflt;
+    usage->voluntary_switches = (int64_t)resources.ru_nvcsw;
+    usage->involuntary_switches = (int64_t)resources.ru_nivcsw;
+    usage->thread_cpu_ns = usage->user_ns + usage->system_ns;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    {
+        struct timespec cpu;
+        if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0)
+            usage->thread_cpu_ns = (int64_t)cpu.tv_sec * 1000000000 + (int64_t)cpu.tv_nsec;
+    }
+#endif
+    return 0;
+#else
+    (void)sizeof(usage);
+    return -1;
+#endif
+}
+static int64_t _usage_metric(const usage_t* usage, const usage_metric_t* metric)
+{
+    return *(const int64_t*)((const char*)usage + metric->offset);
+}
+static void _usage_subtract(usage_t* usage, const usage_t* start)
+{
+    size_t ii;
+    for(ii=0; ii<sizeof(_usage_metrics)/sizeof(_usage_metrics[0]); ++ii)
+        *(int64_t*)((char*)usage + _usage_metrics[ii].offset) -= _usage_metric(start, _usage_metrics + ii);
+}
+static void _usage_record(const char* name, const usage_t* usage)
+{
+    usage_record_t* records = NULL;
+    if(_num_usage_records == _usage_capacity) {
+        _usage_capacity = _usage_capacity ? _usage_capacity * 2 : 64;
+        records = (usage_record_t*)realloc(_usage_records, sizeof(*records) * (size_t)_usage_capacity);
+        if(records == NULL) {
+            _usage_capacity = _num_usage_records;
+            return;
+        }
+        _usage_records = records;
+    }
+    _usage_records[_num_usage_records].name = name;
+    _usage_records[_num_usage_records].usage = *usage;
+    _num_usage_records++;
+}
+static void _buffer_put_metric(buffer_t* buffer, const usage_metric_t* metric, double value)
+{
+    switch(metric->kind)
+    {
+    case 1: _buffer_put_duration(buffer, value); break;
+    case 2: _buffer_printf(buffer, "%.1fMB", value / (1024.0*1024.0)); break;
+    default: _buffer_printf(buffer, "%.0f", value); break;
+    }
+}
+/* A test is an outlier for a metric when it used several times the mean of
+ * the run, and more than the metric's floor.
+ */
+static void _report_usage_outliers(void)
+{
+    buffer_t text = {NULL, 0, 0};
+    const usage_metric_t* metric = NULL;
+    double mean;
+    int64_t value;
+    int num_outliers = 0;
+    size_t ii;
+    int jj;
+    for(ii=0; ii<sizeof(_usage_metrics)/sizeof(_usage_metrics[0]) && num_outliers < USAGE_MAX_OUTLIERS; ++ii) {
+        metric = _usage_metrics + ii;
+        mean = 0.0;
+        for(jj=0; jj<_num_usage_records; ++jj)
+            mean += (double)_usage_metric(&_usage_records[jj].usage, metric);
+        mean /= _num_usage_records ? _num_usage_records : 1;
+        for(jj=0; jj<_num_usage_records && num_outliers < USAGE_MAX_OUTLIERS; ++jj) {
+            value = _usage_metric(&_usage_records[jj].usage, metric);
+            if(value < metric->floor || (double)value <= mean * USAGE_OUTLIER_FACTOR)
+                continue;
+            num_outliers++;
+            if(text.size == 0)
+                _buffer_puts(&text, "Resource outliers:\n");
+            _buffer_printf(&text, "  %s: %s ", _usage_records[jj].name, metric->label);
+            _buffer_put_metric(&text, metric, (double)value);
+            _buffer_puts(&text, " (mean ");
+            _buffer_put_metric(&text, metric, mean);
+            _buffer_puts(&text, ")\n");
+        }
+    }
+    if(text.data)
+        _report_note("%s", text.data);
+    _buffer_free(&text);
+}
+static void _usage_free(void)
+{
+    free(_usage_records);
+    _usage_records = NULL;
+    _num_usage_records = _usage_capacity = 0;
+#ifdef __linux__
+    if(_statm_fd >= 0)
+        close(_statm_fd);
+    _statm_fd = -1;
+#endif
+}
+
+/* Test lifecycle
+ */
+static uint64_t _test_start_time = 0;
+static int      _test_record = -1;
+
+static void _report_test(const test_context_t* context, int record, uint64_t duration)
+{
+    switch(context->result)
+    {
+    case kResultPass: _num_tests_passed++; break;
+    case kResultFail: _num_tests_failed++; break;
+    case kResultIgnore: _num_tests_ignored++; break;
+    }
+    _mutex_lock(&_output_lock);
+    _reporter->test_finished(context, duration);
+    _mutex_unlock(&_output_lock);
+    _journal_end(record, context, duration);
+}
+static void _start_test(const char* name)
+{
+    _reset_context(&_main_context);
+    _main_context.name = name;
+    _main_context.seed = _seed;
+    _test_record = _journal_begin(name);
+    _budgets_open = !_no_usage;
+    _budgets_sampled = 0;
+    _rss_budget.file = NULL;
+    _cpu_budget.file = NULL;
+    if(_measure_usage && _usage_sample(&_test_usage_start) == 0)
+        _main_context.usage_start = &_test_usage_start;
+    _test_start_time = ut_now_ns();
+}
+static void _check_budgets(void);
+static void _finish_test(void)
+{
+    uint64_t duration = ut_now_ns() - _test_start_time;
+    _check_budgets();
+    if(_main_context.usage_start && _usage_sample(&_test_usage) == 0) {
+        _usage_subtract(&_test_usage, &_test_usage_start);
+        _main_context.usage = &_test_usage;
+        _usage_record(_main_context.name, &_test_usage);
+    }
+    _report_test(&_main_context, _test_record, duration);
+    _arena_reset(&_arena);
+}
+
+#if LUA_TESTS
+/* Each Lua test runs as a coroutine. ut.sleep, ut.await and the fd waits
+ * yield back to the scheduler, which resumes the test once its wait is over.
+ */
+typedef enum {
+    kWaitNone,
+    kWaitSleep,
+    kWaitFuture,
+    kWaitFd
+} lua_wait_t;
+
+typedef struct {
+    const char*     name;
+    lua_State*      thread;
+    int             thread_ref;
+    int             record;
+    int             line;
+    int             finished;
+    lua_wait_t      wait;
+    uint64_t        start;
+    uint64_t        deadline;
+    uint64_t        wake_time;
+    int             future_ref;
+    int             fd;
+    int             fd_write;
+    int             fd_ready;
+    test_context_t  context;
+} lua_test_t;
+
+static struct lua_State*    _L = NULL;
+static THREAD_LOCAL char _current_lua_test_file[1024];
+static THREAD_LOCAL lua_test_t* _running_lua_test = NULL;
+
+/* Internal functions
+ */
+static const char* _get_ext(const char* filename)
+{
+    const char* end = filename + strlen(filename);
+    while(end && *end != '.' && end > filename)
+        end--;
+    if(end == filename)
+        return NULL;
+    if(*end == '.')
+        end++;
+    return end;
+}
+static int _lua_line(lua_State* L)
+{
+    lua_Debug ar;
+    lua_getstack(L, 1, &ar);
+    lua_getinfo(L, "nSl", &ar);
+    return ar.currentline;
+}
+static int _FAIL_l(lua_State* L)
+{
+    _fail(_current_lua_test_file, _lua_line(L), lua_tostring(L, 1));
+    return 0;
+}
+
+static int _check_true_l(lua_State* L)
+{
+    _check_true(_current_lua_test_file, _lua_line(L), lua_toboolean(L, 1));
+    return 0;
+}
+static int _check_false_l(lua_State* L)
+{
+    _check_false(_current_lua_test_file, _lua_line(L), lua_toboolean(L, 1));
+    return 0;
+}
+
+static int _check_equal_l(lua_State* L)
+{
+    _check_equal(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
+    return 0;
+}
+static int _check_not_equal_l(lua_State* L)
+{
+    _check_not_equal(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
+    return 0;
+}
+static int _check_less_than_l(lua_State* L)
+{
+    _check_less_than(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
+    return 0;
+}
+static int _check_greater_than_l(lua_State* L)
+{
+    _check_greater_than(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
+    return 0;
+}
+static int _check_less_than_equal_l(lua_State* L)
+{
+    _check_less_than_equal(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
+    return 0;
+}
+static int _check_greater_than_equal_l(lua_State* L)
+{
+    _check_greater_than_equal(_current_lua_test_file, _lua_line(L), lua_tointeger(L, 1), lua_tointeger(L, 2));
+    return 0;
+}
+
+static int _check_null_l(lua_State* L)
+{
+    _check_null(_current_lua_test_file, _lua_line(L), lua_topointer(L, 1));
+    return 0;
+}
+static int _check_not_null_l(lua_State* L)
+{
+    _check_not_null(_current_lua_test_file, _lua_line(L), lua_topointer(L, 1));
+    return 0;
+}
+static int _check_equal_pointer_l(lua_State* L)
+{
+    _check_equal_pointer(_current_lua_test_file, _lua_line(L), lua_topointer(L, 1), lua_topointer(L, 2));
+    return 0;
+}
+static int _check_not_equal_pointer_l(lua_State* L)
+{
+    _check_not_equal_pointer(_current_lua_test_file, _lua_line(L), lua_topointer(L, 1), lua_topointer(L, 2));
+    return 0;
+}
+
+static int _check_equal_float_l(lua_State* L)
+{
+    _check_equal_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
+    return 0;
+}
+static int _check_not_equal_float_l(lua_State* L)
+{
+    _check_not_equal_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
+    return 0;
+}
+static int _check_less_than_float_l(lua_State* L)
+{
+    _check_less_than_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
+    return 0;
+}
+static int _check_greater_than_float_l(lua_State* L)
+{
+    _check_greater_than_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
+    return 0;
+}
+static int _check_less_than_equal_float_l(lua_State* L)
+{
+    _check_less_than_equal_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
+    return 0;
+}
+static int _check_greater_than_equal_float_l(lua_State* L)
+{
+    _check_greater_than_equal_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
+    return 0;
+}
+
+static int _check_equal_string_l(lua_State* L)
+{
+    _check_equal_string(_current_lua_test_file, _lua_line(L), lua_tolstring(L, (1), ((void*)0)), lua_tolstring(L, (2), ((void*)0)));
+    return 0;
+}
+static int _check_not_equal_string_l(lua_State* L)
+{
+    _check_not_equal_string(_current_lua_test_file, _lua_line(L), lua_tolstring(L, (1), ((void*)0)), lua_tolstring(L, (2), ((void*)0)));
+    return 0;
+}
+static lua_test_t* _lua_running_test(lua_State* L, const char* func)
+{
+    if(_running_lua_test == NULL || _running_lua_test->thread != L)
+        luaL_error(L, "%s must be called from a running test", func);
+    return _running_lua_test;
+}
+static int _sleep_l(lua_State* L)
+{
+    lua_Number ms = luaL_checknumber(L, 1);
+    lua_test_t* test = _running_lua_test;
+    if(test == NULL || test->thread != L) {
+        /* Outside a test, e.g. while a file loads, there is nothing to
+         * interleave with */
+#ifndef _WIN32
+        poll(NULL, 0, (int)ms);
+#else
+        Sleep((DWORD)ms);
+#endif
+        return 0;
+    }
+    test->wait = kWaitSleep;
+    test->wake_time = ut_now_ns() + (uint64_t)(ms * 1e6);
+    return lua_yield(L, 0);
+}
+static int _future_l(lua_State* L)
+{
+    lua_newtable(L);
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "done");
+    luaL_getmetatable(L, "ut.future");
+    lua_setmetatable(L, -2);
+    return 1;
+}
+static int _resolve_l(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_setfield(L, 1, "value");
+    lua_pushboolean(L, 1);
+    lua_setfield(L, 1, "done");
+    return 0;
+}
+static int _await_l(lua_State* L)
+{
+    lua_test_t* test = NULL;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "done");
+    if(lua_toboolean(L, -1)) {
+        lua_getfield(L, 1, "value");
+        return 1;
+    }
+    test = _lua_running_test(L, "ut.await");
+    lua_pushvalue(L, 1);
+    test->future_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    test->wait = kWaitFuture;
+    return lua_yield(L, 0);
+}
+static int _wait_fd(lua_State* L, int write, const char* func)
+{
+#ifndef _WIN32
+    lua_test_t* test = _lua_running_test(L, func);
+    if(lua_isuserdata(L, 1)) {
+        /* Every Lua keeps the FILE* first in its file handles */
+        FILE** file = (FILE**)luaL_checkudata(L, 1, LUA_FILEHANDLE);
+        test->fd = *file ? fileno(*file) : -1;
+    } else {
+        test->fd = (int)luaL_checkinteger(L, 1);
+    }
+    test->fd_write = write;
+    test->fd_ready = 0;
+    test->wait = kWaitFd;
+    return lua_yield(L, 0);
+#else
+    (void)sizeof(write);
+    return luaL_error(L, "%s is not supported on Windows", func);
+#endif
+}
+static int _wait_readable_l(lua_State* L)
+{
+    return _wait_fd(L, 0, "ut.wait_readable");
+}
+static int _wait_writable_l(lua_State* L)
+{
+    return _wait_fd(L, 1, "ut.wait_writable");
+}
+static int _set_timeout_l(lua_State* L)
+{
+    lua_test_t* test = _lua_running_test(L, "ut.set_timeout");
+    test->deadline = test->start + (uint64_t)(luaL_checknumber(L, 1) * 1e6);
+    return 0;
+}
+static int _now_l(lua_State* L)
+{
+    lua_pushnumber(L, (lua_Number)ut_now_ns() / 1e6);
+    return 1;
+}
+
+static luaL_Reg _lua_test_methods[] = {
+    { "FAIL", _FAIL_l },
+    { "CHECK_TRUE", _check_true_l },
+    { "CHECK_FALSE", _check_false_l },
+
+    { "CHECK_EQUAL", _check_equal_l },
+    { "CHECK_NOT_EQUAL", _check_not_equal_l },
+    { "CHECK_LESS_THAN", _check_less_than_l },
+    { "CHECK_GREATER_THAN", _check_greater_than_l },
+    { "CHECK_LESS_THAN_EQUAL", _check_less_than_equal_l },
+    { "CHECK_GREATER_THAN_EQUAL", _check_greater_than_equal_l },
+
+    { "CHECK_NULL", _check_null_l },
+    { "CHECK_NOT_NULL", _check_not_null_l },
+    { "CHECK_EQUAL_POINTER", _check_equal_pointer_l },
+    { "CHECK_NOT_EQUAL_POINTER", _check_not_equal_pointer_l },
+
+    { "CHECK_EQUAL_FLOAT", _check_equal_float_l },
+    { "CHECK_NOT_EQUAL_FLOAT", _check_not_equal_float_l },
+    { "CHECK_LESS_THAN_FLOAT", _check_less_than_float_l },
+    { "CHECK_GREATER_THAN_FLOAT", _check_greater_than_float_l },
+    { "CHECK_LESS_THAN_EQUAL_FLOAT", _check_less_than_equal_float_l },
+    { "CHECK_GREATER_THAN_EQUAL_FLOAT", _check_greater_than_equal_float_l },
+
+    { "CHECK_EQUAL_STRING", _check_equal_string_l },
+    { "CHECK_NOT_EQUAL_STRING", _check_not_equal_string_l },
+    { NULL, NULL },
+};
+/* The scheduler functions live in the ut table, times in milliseconds. The
+ * fd waits take a descriptor or a Lua file, such as one from io.popen.
+ */
+static luaL_Reg _lua_ut_methods[] = {
+    { "sleep", _sleep_l },
+    { "future", _future_l },
+    { "await", _await_l },
+    { "wait_readable", _wait_readable_l },
+    { "wait_writable", _wait_writable_l },
+    { "set_timeout", _set_timeout_l },
+    { "now", _now_l },
+    { NULL, NULL },
+};
+static void _report_lua_error(const char* message)
+{
+    const char* colon = message ? strchr(message, ':') : NULL;
+    int line = 0;
+    /* Runtime errors read "chunk:line: message" */
+    while(colon && !isdigit((unsigned char)colon[1]))
+        colon = strchr(colon+1, ':');
+    if(colon)
+        line = atoi(colon+1);
+    _fail(_current_lua_test_file, line, "%s", message ? message : "Lua error");
+}
+
+#endif /* LUA_TESTS */
+
+/* Snapshot functions
+ */
+typedef struct {
+    const char* data;
+    size_t      size;
+} mapped_file_t;
+
+static int _map_file(const char* path, mapped_file_t* file)
+{
+#ifndef _WIN32
+    struct stat st;
+    void* data = NULL;
+    int fd = open(path, O_RDONLY);
+    file->data = "";
+    file->size = 0;
+    if(fd < 0)
+        return -1;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if(st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+        file->data = (const char*)data;
+        file->size = (size_t)st.st_size;
+    }
+    close(fd);
+    return 0;
+#else
+    char* data = NULL;
+    long size = 0;
+    FILE* fp = fopen(path, "rb");
+    file->data = "";
+    file->size = 0;
+    if(fp == NULL)
+        return -1;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if(size > 0) {
+        data = (char*)malloc((size_t)size);
+        if(data == NULL || fread(data, 1, (size_t)size, fp) != (size_t)size) {
+            free(data);
+            fclose(fp);
+            return -1;
+        }
+        file->data = data;
+        file->size = (size_t)size;
+    }
+    fclose(fp);
+    return 0;
+#endif
+}
+static void _unmap_file(mapped_file_t* file)
+{
+    if(file->size == 0)
+        return;
+#ifndef _WIN32
+    munmap((void*)file->data, file->size);
+#else
+    free((void*)file->data);
+#endif
+    file->data = "";
+    file->size = 0;
+}
+static int _write_snapshot(const char* path, const void* buffer, size_t size)
+{
+    char temp[1024];
+    FILE* fp = NULL;
+    int error = 0;
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    fp = fopen(temp, "wb");
+    if(fp == NULL)
+        return -1;
+    if(size > 0 && fwrite(buffer, 1, size, fp) != size)
+        error = 1;
+    if(fflush(fp) != 0)
+        error = 1;
+#ifndef _WIN32
+    if(fsync(fileno(fp)) != 0)
+        error = 1;
+#endif
+    if(fclose(fp) != 0)
+        error = 1;
+    /* Replace the golden file in one step so readers never see a partial file */
+#ifndef _WIN32
+    if(!error && rename(temp, path) != 0)
+        error = 1;
+#else
+    if(!error && !MoveFileExA(temp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        error = 1;
+#endif
+    if(error)
+        remove(temp);
+    return error ? -1 : 0;
+}
+static size_t _find_mismatch(const char* expected, const char* actual, size_t size)
+{
+    enum { kBlockSize = 4096 };
+    size_t offset = 0;
+    while(size - offset > kBlockSize && memcmp(expected + offset, actual + offset, kBlockSize) == 0)
+        offset += kBlockSize;
+    while(offset < size && expected[offset] == actual[offset])
+        offset++;
+    return offset;
+}
+static const char* _next_line(const char* data, size_t size, size_t* offset, size_t* length)
+{
+    const char* start = NULL;
+    const char* end = NULL;
+    if(*offset >= size)
+        return NULL;
+    start = data + *offset;
+    end = (const char*)memchr(start, '\n', size - *offset);
+    *length = end ? (size_t)(end - start) : size - *offset;
+    *offset += *length + (end ? 1 : 0);
+    return start;
+}
+static void _print_snapshot_line(buffer_t* out, char sign, size_t number, const char* line, size_t length)
+{
+    size_t width = length < SNAPSHOT_MAX_LINE_WIDTH ? length : SNAPSHOT_MAX_LINE_WIDTH;
+    _buffer_printf(out, "  %c%6lu | %.*s%s\n", sign, (unsigned long)number, (int)width, line,
+                   length > width ? "..." : "");
+}
+static void _print_text_diff(buffer_t* out, const char* expected, size_t expected_size,
+                             const char* actual, size_t actual_size, size_t mismatch)
+{
+    size_t start = mismatch;
+    size_t number = 1;
+    size_t expected_offset = 0;
+    size_t actual_offset = 0;
+    size_t expected_length = 0;
+    size_t actual_length = 0;
+    const char* expected_line = NULL;
+    const char* actual_line = NULL;
+    const char* newline = expected;
+    int context = 0;
+    int shown = 0;
+    int skipped = 0;
+
+    /* Both buffers are identical up to the mismatch, so they share its line */
+    while(start > 0 && expected[start-1] != '\n')
+        start--;
+    while((newline = (const char*)memchr(newline, '\n', start - (size_t)(newline - expected))) != NULL) {
+        newline++;
+        number++;
+    }
+    while(context < SNAPSHOT_CONTEXT_LINES && start > 0) {
+        start--;
+        while(start > 0 && expected[start-1] != '\n')
+            start--;
+        number--;
+        context++;
+    }
+
+    /* Walk both buffers a line at a time, printing differing lines with a
+     * little context and eliding long runs of equal lines */
+    context = 0;
+    expected_offset = actual_offset = start;
+    for(;;) {
+        expected_line = _next_line(expected, expected_size, &expected_offset, &expected_length);
+        actual_line = _next_line(actual, actual_size, &actual_offset, &actual_length);
+        if(expected_line == NULL && actual_line == NULL)
+            break;
+        if(expected_line && actual_line && expected_length == actual_length &&
+           memcmp(expected_line, actual_line, expected_length) == 0) {
+            if(context < SNAPSHOT_CONTEXT_LINES) {
+                _print_snapshot_line(out, ' ', number, expected_line, expected_length);
+                context++;
+            } else if(!skipped) {
+                skipped = 1;
+                if(expected_size - expected_offset == actual_size - actual_offset &&
+                   memcmp(expected + expected_offset, actual + actual_offset, actual_size - actual_offset) == 0)
+                    break;
+            }
+        } else {
+            if(shown == SNAPSHOT_MAX_DIFF_LINES) {
+                _buffer_puts(out, "  ... (diff truncated)\n");
+                break;
+            }
+            if(skipped)
+                _buffer_puts(out, "  ...\n");
+            if(expected_line)
+                _print_snapshot_line(out, '-', number, expected_line, expected_length);
+            if(actual_line)
+                _print_snapshot_line(out, '+', number, actual_line, actual_length);
+            shown++;
+            context = 0;
+            skipped = 0;
+        }
+        number++;
+    }
+}
+static void _print_hex_window(buffer_t* out, char sign, const char* data, size_t size, size_t offset)
+{
+    size_t start = offset - offset % SNAPSHOT_HEX_WINDOW;
+    size_t ii;
+    _buffer_printf(out, "  %c%08lx |", sign, (unsigned long)start);
+    for(ii = start; ii < start + SNAPSHOT_HEX_WINDOW && ii < size; ++ii)
+        _buffer_printf(out, " %02x", (unsigned int)(unsigned char)data[ii]);
+    _buffer_puts(out, "\n");
+}
+static int _is_binary(const char* data, size_t size)
+{
+    enum { kSniffSize = 8192 };
+    return memchr(data, '\0', size < kSniffSize ? size : kSniffSize) != NULL;
+}
+
+/* Change selection
+ *  Changed files are mapped to test translation units through the -MMD
+ *  dependency file the makefile writes next to each object. A changed source
+ *  file also counts as a change to headers with the same base name, so
+ *  editing foo.c selects the tests that include foo.h.
+ *
+ *  Every path is made absolute before it is compared. Paths from git are
+ *  relative to the top of the work tree. Paths in __FILE__ and in dependency
+ *  files are relative to the build directory: --build-dir, or else the top
+ *  of the work tree, or else the current directory. Other changed paths are
+ *  relative to the current directory when the file exists there, and
+ *  otherwise to the top of the work tree.
+ */
+typedef struct {
+    char**  strings;
+    int     count;
+    int     capacity;
+} string_list_t;
+
+static string_list_t    _changed_files = {NULL, 0, 0};
+static int              _select_changed = 0;
+static const char*      _build_dir = NULL;
+static char             _top_dir[1024] = {0};
+
+static void _string_list_add(string_list_t* list, const char* str, size_t length)
+{
+    char** strings = NULL;
+    char* copy = NULL;
+    if(list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        strings = (char**)realloc(list->strings, (size_t)capacity * sizeof(char*));
+        if(strings == NULL)
+            return;
+        list->strings = strings;
+        list->capacity = capacity;
+    }
+    copy = (char*)malloc(length + 1);
+    if(copy == NULL)
+        return;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    list->strings[list->count++] = copy;
+}
+static void _string_list_free(string_list_t* list)
+{
+    int ii;
+    for(ii=0; ii<list->count; ++ii)
+        free(list->strings[ii]);
+    free(list->strings);
+    list->strings = NULL;
+    list->count = list->capacity = 0;
+}
+static void _add_lines(string_list_t* list, const char* data, size_t size)
+{
+    size_t offset = 0;
+    size_t length = 0;
+    const char* line = NULL;
+    while((line = _next_line(data, size, &offset, &length)) != NULL) {
+        while(length > 0 && (line[length-1] == '\r' || line[length-1] == ' '))
+            length--;
+        if(length > 0)
+            _string_list_add(list, line, length);
+    }
+}
+static void _read_changed_list(const char* path)
+{
+    mapped_file_t file;
+    char line[1024];
+    _select_changed = 1;
+    if(strcmp(path, "-") == 0) {
+        while(fgets(line, sizeof(line), stdin))
+            _add_lines(&_changed_files, line, strlen(line));
+        return;
+    }
+    if(_map_file(path, &file) != 0) {
+        perror(path);
+        return;
+    }
+    _add_lines(&_changed_files, file.data, file.size);
+    _unmap_file(&file);
+}
+/* Runs git with args, a NULL-terminated list starting with "git", adding
+ * each line it prints to lines. The arguments never pass through a shell.
+ * Returns git's exit status, or -1 if it could not run.
+ */
+static int _read_git_lines(const char* const* args, string_list_t* lines, int quiet)
+{
+    char line[1024];
+    FILE* output = NULL;
+    int status = -1;
+#ifndef _WIN32
+    int fds[2];
+    pid_t pid;
+    fflush(stdout);
+    if(pipe(fds) != 0)
+        return -1;
+    pid = fork();
+    if(pid == 0) {
+        int null_fd = quiet ? open("/dev/null", O_WRONLY) : -1;
+        if(null_fd >= 0)
+            dup2(null_fd, STDERR_FILENO);
+        if(dup2(fds[1], STDOUT_FILENO) >= 0) {
+            close(fds[0]);
+            close(fds[1]);
+            execvp("git", (char* const*)args);
+        }
+        _exit(127);
+    }
+    close(fds[1]);
+    if(pid < 0 || (output = fdopen(fds[0], "r")) == NULL) {
+        close(fds[0]);
+        if(pid > 0)
+            waitpid(pid, &status, 0);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), output))
+        _add_lines(lines, line, strlen(line));
+    fclose(output);
+    if(waitpid(pid, &status, 0) != pid)
+        return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#else
+    /* _popen goes through cmd.exe, so only quote arguments it can't misread */
+    buffer_t command = {NULL, 0, 0};
+    for(; *args; ++args) {
+        if(strpbrk(*args, "\"%^&|<>") != NULL) {
+            _buffer_free(&command);
+            return -1;
+        }
+        _buffer_printf(&command, "%s\"%s\"", command.size ? " " : "", *args);
+    }
+    if(quiet)
+        _buffer_puts(&command, " 2>NUL");
+    output = command.data ? _popen(command.data, "r") : NULL;
+    _buffer_free(&command);
+    if(output == NULL)
+        return -1;
+    while(fgets(line, sizeof(line), output))
+        _add_lines(lines, line, strlen(line));
+    status = _pclose(output);
+    return status;
+#endif
+}
+/* Returns the top of the git work tree, or NULL outside of one */
+static const char* _git_top_dir(void)
+{
+    static int looked = 0;
+    const char* args[] = {"git", "rev-parse", "--show-toplevel", NULL};
+    string_list_t lines = {NULL, 0, 0};
+    if(!looked && _read_git_lines(args, &lines, 1) == 0 && lines.count == 1)
+        snprintf(_top_dir, sizeof(_top_dir), "%s", lines.strings[0]);
+    looked = 1;
+    _string_list_free(&lines);
+    return _top_dir[0] ? _top_dir : NULL;
+}
+static int _read_git_changes(const char* base)
+{
+    const char* args[] = {"git", "diff", "--name-only", NULL, "--", NULL};
+    string_list_t lines = {NULL, 0, 0};
+    const char* top = _git_top_dir();
+    char path[1024];
+    int ii;
+    _select_changed = 1;
+    args[3] = base;
+    if(top == NULL || _read_git_lines(args, &lines, 0) != 0) {
+        fprintf(stderr, "Could not list the files changed since %s\n", base);
+        _string_list_free(&lines);
+        return -1;
+    }
+    for(ii=0; ii<lines.count; ++ii) {
+        snprintf(path, sizeof(path), "%s/%s", top, lines.strings[ii]);
+        _string_list_add(&_changed_files, path, strlen(path));
+    }
+    _string_list_free(&lines);
+    return 0;
+}
+static int _is_absolute(const char* path)
+{
+#ifdef _WIN32
+    if(isalpha((unsigned char)path[0]) && path[1] == ':')
+        return 1;
+    if(path[0] == '\\')
+        return 1;
+#endif
+    return path[0] == '/';
+}
+/* Joins base and the first length bytes of path, unless path is absolute,
+ * and removes "." and ".." components so equal paths compare equal
+ */
+static void _resolve_path(char* out, size_t size, const char* base, const char* path, size_t length)
+{
+    char* root = out;
+    char* write = out;
+    const char* read = out;
+    if(base && !_is_absolute(path))
+        snprintf(out, size, "%s/%.*s", base, (int)length, path);
+    else
+        snprintf(out, size, "%.*s", (int)length, path);
+#ifdef _WIN32
+    for(; *write; ++write) {
+        if(*write == '\\')
+            *write = '/';
+    }
+    write = out;
+    if(isalpha((unsigned char)out[0]) && out[1] == ':')
+        root = write = out + 2;
+#endif
+    if(*root == '/')
+        root = ++write;
+    read = write;
+    while(*read) {
+        const char* component = read;
+        size_t component_length = 0;
+        while(*read && *read != '/')
+            read++;
+        component_length = (size_t)(read - component);
+        if(*read == '/')
+            read++;
+        if(component_length == 0 || (component_length == 1 && component[0] == '.'))
+            continue;
+        if(component_length == 2 && component[0] == '.' && component[1] == '.') {
+            while(write > root && write[-1] != '/')
+                write--;
+            if(write > root)
+                write--;
+            continue;
+        }
+        /* The source had a separator here too, so this never passes read */
+        if(write > root)
+            *write++ = '/';
+        memmove(write, component, component_length);
+        write += component_length;
+    }
+    *write = '\0';
+}
+/* Directory that relative source and dependency file paths start from */
+static const char* _source_dir(void)
+{
+    static char dir[1024];
+    char cwd[1024];
+    if(dir[0])
+        return dir;
+    if(getcwd(cwd, sizeof(cwd)) == NULL)
+        return NULL;
+    if(_build_dir)
+        _resolve_path(dir, sizeof(dir), cwd, _build_dir, strlen(_build_dir));
+    else
+        snprintf(dir, sizeof(dir), "%s", _git_top_dir() ? _top_dir : cwd);
+    return dir;
+}
+/* Makes the changed paths absolute; see the top of this section */
+static void _resolve_changed_files(void)
+{
+    string_list_t resolved = {NULL, 0, 0};
+    char cwd[1024] = {0};
+    char path[1024];
+    const char* top = _git_top_dir();
+    FILE* file = NULL;
+    int ii;
+    if(getcwd(cwd, sizeof(cwd)) == NULL)
+        perror("Could not get current working directory");
+    for(ii=0; ii<_changed_files.count; ++ii) {
+        const char* changed = _changed_files.strings[ii];
+        _resolve_path(path, sizeof(path), cwd, changed, strlen(changed));
+        if(top && !_is_absolute(changed)) {
+            if((file = fopen(path, "rb")) != NULL)
+                fclose(file);
+            else
+                _resolve_path(path, sizeof(path), top, changed, strlen(changed));
+        }
+        _string_list_add(&resolved, path, strlen(path));
+    }
+    _string_list_free(&_changed_files);
+    _changed_files = resolved;
+}
+static void _path_stem(const char* path, size_t length, const char** stem, size_t* stem_length)
+{
+    const char* end = path + length;
+    const char* start = end;
+    const char* dot = NULL;
+    while(start > path && start[-1] != '/' && start[-1] != '\\') {
+        start--;
+        if(*start == '.' && dot == NULL)
+            dot = start;
+    }
+    *stem = start;
+    *stem_length = (size_t)((dot ? dot : end) - start);
+}
+static int _is_header(const char* path, size_t length)
+{
+    static const char* extensions[] = { ".h", ".hh", ".hpp", ".hxx", ".inl" };
+    size_t ii;
+    for(ii=0; ii<sizeof(extensions)/sizeof(extensions[0]); ++ii) {
+        size_t ext_length = strlen(extensions[ii]);
+        if(length > ext_length && memcmp(path + length - ext_length, extensions[ii], ext_length) == 0)
+            return 1;
+    }
+    return 0;
+}
+/* Tells whether path, relative to base unless absolute, is a changed file */
+static int _is_changed(const char* base, const char* path, size_t length)
+{
+    char resolved[1024];
+    const char* stem = NULL;
+    const char* changed_stem = NULL;
+    size_t stem_length = 0;
+    size_t changed_stem_length = 0;
+    int ii;
+    _resolve_path(resolved, sizeof(resolved), base, path, length);
+    for(ii=0; ii<_changed_files.count; ++ii) {
+        if(strcmp(resolved, _changed_files.strings[ii]) == 0)
+            return 1;
+    }
+    length = strlen(resolved);
+    if(!_is_header(resolved, length))
+        return 0;
+    _path_stem(resolved, length, &stem, &stem_length);
+    for(ii=0; ii<_changed_files.count; ++ii) {
+        const char* changed = _changed_files.strings[ii];
+        size_t changed_length = strlen(changed);
+        if(_is_header(changed, changed_length))
+            continue;
+        _path_stem(changed, changed_length, &changed_stem, &changed_stem_length);
+        if(stem_length == changed_stem_length && memcmp(stem, changed_stem, stem_length) == 0)
+            return 1;
+    }
+    return 0;
+}
+static int _depends_on_changes(const char* source)
+{
+    char dep_path[1024];
+    const char* base = _source_dir();
+    const char* ext = NULL;
+    mapped_file_t deps;
+    size_t ii = 0;
+    int affected = 0;
+
+    /* The makefile writes foo.d next to foo.o, which sits next to foo.c */
+    _resolve_path(dep_path, sizeof(dep_path), base, source, strlen(source));
+    ext = strrchr(dep_path, '.');
+    if(ext == NULL || strchr(ext, '/') != NULL)
+        return 1;
+    snprintf(dep_path + (ext - dep_path), sizeof(dep_path) - (size_t)(ext - dep_path), ".d");
+    if(_map_file(dep_path, &deps) != 0)
+        return 1; /* No dependency information, so it can't be ruled out */
+
+    while(ii < deps.size && !affected) {
+        size_t start;
+        while(ii < deps.size && (deps.data[ii] == ' ' || deps.data[ii] == '\t' ||
+                                 deps.data[ii] == '\n' || deps.data[ii] == '\r' ||
+                                 (deps.data[ii] == '\\' && ii+1 < deps.size &&
+                                  (deps.data[ii+1] == '\n' || deps.data[ii+1] == '\r'))))
+            ii++;
+        start = ii;
+        while(ii < deps.size && deps.data[ii] != ' ' && deps.data[ii] != '\t' &&
+              deps.data[ii] != '\n' && deps.data[ii] != '\r')
+            ii++;
+        if(ii == start || deps.data[ii-1] == ':') /* Skip targets */
+            continue;
+        affected = _is_changed(base, deps.data + start, ii - start);
+    }
+    _unmap_file(&deps);
+    return affected;
+}
+static void _select_tests(void)
+{
+    int num_selected = 0;
+    int ii;
+    int jj;
+    _resolve_changed_files();
+    for(ii=0; ii<_num_tests; ++ii) {
+        /* Tests from the same translation unit share a dependency file */
+        for(jj=0; jj<ii; ++jj) {
+            if(_tests[jj].file == _tests[ii].file || strcmp(_tests[jj].file, _tests[ii].file) == 0)
+                break;
+        }
+        _tests[ii].selected = jj < ii ? _tests[jj].selected : _depends_on_changes(_tests[ii].file);
+        num_selected += _tests[ii].selected;
+    }
+    if(!_quiet)
+        _report_note("Selected %d of %d tests for %d changed files\n", num_selected, _num_tests, _changed_files.count);
+}
+
+/* Stress functions
+ */
+typedef struct {
+    mutex_t lock;
+    cond_t  cond;
+    int     count;
+    int     total;
+    int     generation;
+} barrier_t;
+
+typedef struct {
+    ut_stress_func_t*   func;
+    void*               data;
+    test_context_t*     context;
+    barrier_t           barrier;
+    int                 flags;
+    int                 round;
+    int                 stop;
+    uint32_t            seed;
+} stress_t;
+
+typedef struct {
+    stress_t*   stress;
+    thread_t    thread;
+    int         index;
+} stress_worker_t;
+
+static THREAD_LOCAL uint32_t _stress_random = 0;
+
+static void _barrier_wait(barrier_t* barrier)
+{
+    int generation;
+    _mutex_lock(&barrier->lock);
+    generation = barrier->generation;
+    if(++barrier->count == barrier->total) {
+        barrier->count = 0;
+        barrier->generation++;
+        _cond_broadcast(&barrier->cond);
+    } else {
+        while(generation == barrier->generation)
+            _cond_wait(&barrier->cond, &barrier->lock);
+    }
+    _mutex_unlock(&barrier->lock);
+}
+static uint32_t _xorshift32(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+static THREAD_FUNC(_stress_thread, arg)
+{
+    stress_worker_t* worker = (stress_worker_t*)arg;
+    stress_t* stress = worker->stress;
+    _thread_context = stress->context;
+    if(stress->flags & UT_STRESS_RANDOM_YIELD)
+        _stress_random = stress->seed + (uint32_t)worker->index * 0x9E3779B9u;
+    for(;;) {
+        _barrier_wait(&stress->barrier);
+        if(stress->stop)
+            break;
+        ut_stress_yield();
+        stress->func(stress->data, worker->index, stress->round);
+        _barrier_wait(&stress->barrier);
+    }
+    /* Stress threads do not outlive ut_stress; neither does their memory */
+    _arena_free(&_arena);
+    _thread_context = NULL;
+    _stress_random = 0;
+    return THREAD_RETURN;
+}
+
+/* Histogram functions
+ */
+static int _highest_bit(uint64_t value)
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(value);
+#elif defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#else
+    int bit = 0;
+    int shift;
+    for(shift = 32; shift > 0; shift >>= 1) {
+        if(value >> shift) {
+            value >>= shift;
+            bit += shift;
+        }
+    }
+    return bit;
+#endif
+}
+static int _hist_index(uint64_t value)
+{
+    int magnitude;
+    if(value < UT_HIST_SUB_BUCKETS)
+        return (int)value;
+    magnitude = _highest_bit(value) - (UT_HIST_SUB_BUCKET_BITS - 1);
+    return magnitude * (UT_HIST_SUB_BUCKETS / 2) + (int)(value >> magnitude);
+}
+static uint64_t _hist_highest_value(int index)
+{
+    int magnitude = index / (UT_HIST_SUB_BUCKETS / 2) - 1;
+    uint64_t sub_bucket;
+    if(magnitude <= 0)
+        return (uint64_t)index;
+    sub_bucket = (uint64_t)(index - magnitude * (UT_HIST_SUB_BUCKETS / 2));
+    return ((sub_bucket + 1) << magnitude) - 1;
+}
+static void _print_histogram(buffer_t* out, const ut_histogram_t* histogram)
+{
+    static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+    int ii;
+    _buffer_printf(out, "  count: %"PRIu64"  min: %"PRIu64"  mean: %"PRIu64"  max: %"PRIu64"\n",
+                   histogram->count, histogram->min,
+                   histogram->count ? histogram->sum / histogram->count : 0, histogram->max);
+    for(ii=0; ii<(int)(sizeof(percentiles)/sizeof(percentiles[0])); ++ii)
+        _buffer_printf(out, "  p%-6g %"PRIu64"\n", percentiles[ii], ut_hist_percentile(histogram, percentiles[ii]));
+}
+
+/* Lua runner
+ */
+#if LUA_TESTS
+static const char _lua_env_script[] =
+    "function _new_env()\n"\
+    "  return setmetatable({}, {__index = _G})\n"\
+    "end\n"\
+    "function _test_names(env)\n"\
+    "  local names = {}\n"\
+    "  for key, val in pairs(env) do\n"\
+    "    if \"function\" == type(val) and string.find(key, \"_Test\") then\n"\
+    "      names[#names+1] = key\n"\
+    "    end\n"\
+    "  end\n"\
+    "  table.sort(names)\n"\
+    "  return names\n"\
+    "end";
+
+static lua_State* _create_lua_state(void)
+{
+    lua_State* L = luaL_newstate();
+    int ii;
+    luaL_openlibs(L);
+    for(ii=0; ii<(int)sizeof(_lua_test_methods)/(int)sizeof(_lua_test_methods[0])-1; ++ii) {
+        lua_pushcfunction(L, _lua_test_methods[ii].func);
+        lua_setglobal(L, _lua_test_methods[ii].name);
+    }
+    lua_newtable(L);
+    for(ii=0; _lua_ut_methods[ii].name; ++ii) {
+        lua_pushcfunction(L, _lua_ut_methods[ii].func);
+        lua_setfield(L, -2, _lua_ut_methods[ii].name);
+    }
+    lua_setglobal(L, "ut");
+    luaL_newmetatable(L, "ut.future");
+    lua_newtable(L);
+    lua_pushcfunction(L, _resolve_l);
+    lua_setfield(L, -2, "resolve");
+    lua_pushcfunction(L, _await_l);
+    lua_setfield(L, -2, "await");
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    luaL_dostring(L, _lua_env_script);
+    return L;
+}
+static int _is_lua_test_file(const char* name)
+{
+    const char* ext = _get_ext(name);
+    if(ext == NULL || strcmp(ext, "lua") != 0)
+        return 0;
+    if(name[0] == '.' && name[1] == '_') /* Ignore OS X ._* files*/
+        return 0;
+    return 1;
+}
+/* Loads a test file and leaves its environment on the stack. Each file gets
+ * fresh globals that fall back to the shared ones, so a warm state can run
+ * files repeatedly without them seeing each other.
+ */
+static int _load_lua_env(lua_State* L, const char* name)
+{
+    if(luaL_loadfile(L, name)) {
+        _report_note("%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_getglobal(L, "_new_env");
+    lua_call(L, 0, 1);
+    lua_pushvalue(L, -1);
+#if LUA_VERSION_NUM >= 502
+    lua_setupvalue(L, -3, 1);
+#else
+    lua_setfenv(L, -3);
+#endif
+    lua_insert(L, -2);
+    if(lua_pcall(L, 0, 0, 0)) {
+        _report_note("%s\n", lua_tostring(L, -1));
+        lua_pop(L, 2);
+        return 0;
+    }
+    return 1;
+}
+static int _lua_resume(lua_State* thread, lua_State* from, int nargs)
+{
+#if LUA_VERSION_NUM >= 504
+    int nresults = 0;
+    return lua_resume(thread, from, nargs, &nresults);
+#elif LUA_VERSION_NUM >= 502
+    return lua_resume(thread, from, nargs);
+#else
+    (void)sizeof(from);
+    return lua_resume(thread, nargs);
+#endif
+}
+static int _lua_test_ready(lua_State* L, const lua_test_t* test, uint64_t now)
+{
+    int done;
+    switch(test->wait)
+    {
+    case kWaitNone: return 1;
+    case kWaitSleep: return now >= test->wake_time;
+    case kWaitFd: return test->fd_ready;
+    case kWaitFuture:
+        lua_rawgeti(L, LUA_REGISTRYINDEX, test->future_ref);
+        lua_getfield(L, -1, "done");
+        done = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+        return done;
+    }
+    return 0;
+}
+/* Returns non-zero while the test is still waiting on something */
+static int _resume_lua_test(lua_State* L, lua_test_t* test)
+{
+    test_context_t* previous = NULL;
+    int nargs = 0;
+    int status;
+    if(test->wait == kWaitFuture) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, test->future_ref);
+        lua_getfield(L, -1, "value");
+        lua_xmove(L, test->thread, 1);
+        lua_pop(L, 1);
+        luaL_unref(L, LUA_REGISTRYINDEX, test->future_ref);
+        test->future_ref = LUA_NOREF;
+        nargs = 1;
+    } else if(test->wait == kWaitFd) {
+        lua_pushboolean(test->thread, 1);
+        nargs = 1;
+    }
+    test->wait = kWaitNone;
+    _running_lua_test = test;
+    previous = _enter_context(&test->context);
+    status = _lua_resume(test->thread, L, nargs);
+    if(status != LUA_YIELD && status != 0)
+        _report_lua_error(lua_tostring(test->thread, -1));
+    _thread_context = previous;
+    _running_lua_test = NULL;
+    return status == LUA_YIELD;
+}
+static void _finish_lua_test(lua_State* L, lua_test_t* test, test_context_t* into)
+{
+    test->finished = 1;
+    luaL_unref(L, LUA_REGISTRYINDEX, test->future_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, test->thread_ref);
+    if(into) {
+        test->context.name = into->name;
+        *into = test->context;
+    } else {
+        _report_test(&test->context, test->record, ut_now_ns() - test->start);
+    }
+}
+/* Resumes every test that can make progress, then sleeps until the next
+ * wake up or deadline, or until a descriptor some test waits on is ready.
+ */
+static void _run_lua_scheduler(lua_State* L, lua_test_t* tests, int count, test_context_t* into)
+{
+#ifndef _WIN32
+    struct pollfd* fds = (struct pollfd*)calloc((size_t)(count ? count : 1), sizeof(*fds));
+    int* fd_tests = (int*)calloc((size_t)(count ? count : 1), sizeof(*fd_tests));
+#endif
+    test_context_t* outer = _active_context;
+    test_context_t* previous = NULL;
+    uint64_t now, next;
+    int pending = 0;
+    int ran, nfds, timeout_ms;
+    int ii;
+
+    for(ii=0; ii<count; ++ii)
+        pending += !tests[ii].finished;
+    while(pending) {
+        ran = 0;
+        now = ut_now_ns();
+        for(ii=0; ii<count; ++ii) {
+            lua_test_t* test = tests + ii;
+            if(test->finished)
+                continue;
+            if(now >= test->deadline) {
+                previous = _thread_context;
+                _thread_context = &test->context;
+                _fail(_current_lua_test_file, test->line, "%s timed out after %.0fms",
+                      test->name, (double)(now - test->start) / 1e6);
+                _thread_context = previous;
+            } else if(!_lua_test_ready(L, test, now)) {
+                continue;
+            } else {
+                ran = 1;
+                if(_resume_lua_test(L, test))
+                    continue;
+            }
+            _leave_active_context(&test->context, outer);
+            _finish_lua_test(L, test, into);
+            pending--;
+        }
+        if(pending == 0)
+            break;
+
+        next = (uint64_t)-1;
+        nfds = 0;
+        now = ut_now_ns();
+        for(ii=0; ii<count; ++ii) {
+            const lua_test_t* test = tests + ii;
+            if(test->finished)
+                continue;
+            if(test->deadline < next)
+                next = test->deadline;
+            if(test->wait == kWaitSleep && test->wake_time < next)
+                next = test->wake_time;
+#ifndef _WIN32
+            if(test->wait == kWaitFd && fds && fd_tests) {
+                fds[nfds].fd = test->fd;
+                fds[nfds].events = test->fd_write ? POLLOUT : POLLIN;
+                fds[nfds].revents = 0;
+                fd_tests[nfds++] = ii;
+            }
+#endif
+        }
+        if(ran || next <= now)
+            timeout_ms = 0;
+        else if(next - now > 3600000000000u)
+            timeout_ms = 3600000;
+        else
+            timeout_ms = (int)((next - now + 999999) / 1000000);
+#ifndef _WIN32
+        if((nfds || timeout_ms) && poll(fds, (nfds_t)nfds, timeout_ms) > 0) {
+            for(ii=0; ii<nfds; ++ii)
+                tests[fd_tests[ii]].fd_ready = fds[ii].revents != 0;
+        }
+#else
+        if(timeout_ms)
+            Sleep((DWORD)timeout_ms);
+#endif
+    }
+#ifndef _WIN32
+    free(fds);
+    free(fd_tests);
+#endif
+}
+/* Runs the tests in the environment on top of the stack as coroutines. When
+ * only is given just that test runs, and its result goes into the context.
+ */
+static void _run_lua_env(lua_State* L, const char* only, test_context_t* into)
+{
+    lua_test_t* tests = NULL;
+    lua_test_t* test = NULL;
+    lua_Debug info;
+    int count = 0;
+    int ii;
+
+    lua_getglobal(L, "_test_names");
+    lua_pushvalue(L, -2);
+    lua_call(L, 1, 1);
+    for(ii=1; ; ++ii) {
+        lua_rawgeti(L, -1, ii);
+        if(lua_isnil(L, -1))
+            break;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    tests = (lua_test_t*)calloc((size_t)ii, sizeof(*tests));
+    for(ii=1; tests; ++ii) {
+        lua_rawgeti(L, -1, ii);
+        if(lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        test = tests + count;
+        test->name = lua_tostring(L, -1);
+        lua_pop(L, 1);
+        if(only && strcmp(test->name, only) != 0)
+            continue;
+        count++;
+        if(into) {
+            test->context = *into;
+        } else {
+            _reset_context(&test->context);
+            test->context.seed = _seed;
+        }
+        test->context.name = test->name;
+        test->thread_ref = LUA_NOREF;
+        test->future_ref = LUA_NOREF;
+        test->record = into ? -1 : _journal_begin(test->name);
+        test->start = ut_now_ns();
+        test->deadline = test->start + (uint64_t)_test_timeout_ms * 1000000u;
+        if(strstr(test->name, "Ignore_")) {
+            test->context.result = kResultIgnore;
+            _finish_lua_test(L, test, into);
+            continue;
+        }
+        test->thread = lua_newthread(L);
+        lua_getfield(L, -3, test->name);
+        lua_pushvalue(L, -1);
+        lua_getinfo(L, ">S", &info);
+        test->line = info.linedefined;
+        lua_xmove(L, test->thread, 1);
+        test->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    /* The names table keeps the test names alive until the tests finish */
+    _run_lua_scheduler(L, tests, count, into);
+    lua_pop(L, 1);
+    free(tests);
+}
+static void _run_lua_file(lua_State* L, const char* cwd, const char* name)
+{
+    snprintf(_current_lua_test_file, sizeof(_current_lua_test_file), "%s/%s", cwd, name);
+    _reset_context(&_main_context);
+    if(!_load_lua_env(L, name))
+        return;
+    _run_lua_env(L, NULL, NULL);
+    lua_pop(L, 1);
+}
+/* Runs one test from a file, loading the file into the state the first time */
+static void _run_lua_test(lua_State* L, const char* cwd, const char* file, const char* name)
+{
+    snprintf(_current_lua_test_file, sizeof(_current_lua_test_file), "%s/%s", cwd, file);
+    lua_getfield(L, LUA_REGISTRYINDEX, file);
+    if(lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        if(!_load_lua_env(L, file)) {
+            _fail(_current_lua_test_file, 0, "Could not load %s", file);
+            return;
+        }
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, file);
+    }
+    _run_lua_env(L, name, _current_context());
+    lua_pop(L, 1);
+}
+static void _list_lua_files(string_list_t* files)
+{
+    DIR *dir = NULL;
+    struct dirent *ent = NULL;
+    char cwd[1024] = {0};
+    if(_select_changed && getcwd(cwd, sizeof(cwd)) == NULL)
+        perror("Could not get current working directory");
+    if ((dir = opendir (".")) != NULL) {
+        while ((ent = readdir (dir)) != NULL) {
+            if(!_is_lua_test_file(ent->d_name))
+                continue;
+            if(_select_changed && !_is_changed(cwd, ent->d_name, strlen(ent->d_name)))
+                continue;
+            _string_list_add(files, ent->d_name, strlen(ent->d_name));
+        }
+        closedir (dir);
+    } else {
+        /* could not open directory */
+        perror ("");
+    }
+}
+static void _run_lua_tests(lua_State* L)
+{
+    char cwd[1024] = {0};
+    string_list_t files = {NULL, 0, 0};
+    int ii;
+    if(getcwd(cwd, sizeof(cwd)) == NULL)
+        perror("Could not get current working directory");
+    _list_lua_files(&files);
+    for(ii=0; ii<files.count; ++ii)
+        _run_lua_file(L, cwd, files.strings[ii]);
+    _string_list_free(&files);
+}
+#endif /* LUA_TESTS */
+
+/* Async tests
+ *  Every selected ASYNC_TEST starts at once and they share one event loop:
+ *  epoll on Linux, poll on other POSIX systems and timers only on Windows.
+ *  A test finishes when it calls ut_done, or fails when its deadline passes
+ *  first. Callbacks run with the owning test's context.
+ */
+typedef struct {
+    ut_async_t*     test;   /**< NULL for a free slot */
+    int             fd;
+    int             events;
+    ut_io_func_t*   func;
+    void*           data;
+} async_watch_t;
+
+typedef struct {
+    ut_async_t*         test;   /**< NULL for a free slot */
+    uint64_t            when;
+    ut_timer_func_t*    func;
+    void*               data;
+} async_timer_t;
+
+typedef struct {
+    async_watch_t*  watches;
+    int             num_watches;
+    async_timer_t*  timers;
+    int             num_timers;
+    int             epoll_fd;
+    test_context_t* outer_context;  /**< Active again as the tests finish */
+} async_loop_t;
+
+struct ut_async_t {
+    async_loop_t*       loop;
+    async_test_func_t*  func;
+    const char*         file;
+    int                 line;
+    test_context_t      context;
+    int                 record;
+    int                 done;
+    int                 finished;
+    uint64_t            start;
+    uint64_t            deadline;
+};
+
+enum { ASYNC_MAX_EVENTS = 64 };
+
+static test_context_t* _async_enter(ut_async_t* test)
+{
+    return _enter_context(&test->context);
+}
+static async_watch_t* _async_new_watch(async_loop_t* loop)
+{
+    async_watch_t* watches = NULL;
+    int capacity = loop->num_watches ? loop->num_watches * 2 : 16;
+    int ii;
+    for(ii=0; ii<loop->num_watches; ++ii) {
+        if(loop->watches[ii].test == NULL)
+            return loop->watches + ii;
+    }
+    watches = (async_watch_t*)realloc(loop->watches, (size_t)capacity * sizeof(*watches));
+    if(watches == NULL)
+        return NULL;
+    memset(watches + ii, 0, (size_t)(capacity - ii) * sizeof(*watches));
+    loop->watches = watches;
+    loop->num_watches = capacity;
+    return watches + ii;
+}
+static async_timer_t* _async_new_timer(async_loop_t* loop)
+{
+    async_timer_t* timers = NULL;
+    int capacity = loop->num_timers ? loop->num_timers * 2 : 16;
+    int ii;
+    for(ii=0; ii<loop->num_timers; ++ii) {
+        if(loop->timers[ii].test == NULL)
+            return loop->timers + ii;
+    }
+    timers = (async_timer_t*)realloc(loop->timers, (size_t)capacity * sizeof(*timers));
+    if(timers == NULL)
+        return NULL;
+    memset(timers + ii, 0, (size_t)(capacity - ii) * sizeof(*timers));
+    loop->timers = timers;
+    loop->num_timers = capacity;
+    return timers + ii;
+}
+static async_watch_t* _async_find_watch(async_loop_t* loop, int fd)
+{
+    int ii;
+    for(ii=0; ii<loop->num_watches; ++ii) {
+        if(loop->watches[ii].test && loop->watches[ii].fd == fd)
+            return loop->watches + ii;
+    }
+    return NULL;
+}
+static void _async_remove_watch(async_loop_t* loop, async_watch_t* watch)
+{
+#ifdef __linux__
+    struct epoll_event event;
+    /* Fails harmlessly if the fd was already closed */
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, &event);
+#else
+    (void)sizeof(loop);
+#endif
+    watch->test = NULL;
+}
+static void _async_call_io(const async_watch_t* watch, int events)
+{
+    test_context_t* previous = _async_enter(watch->test);
+    watch->func(watch->test, watch->fd, events, watch->data);
+    _thread_context = previous;
+}
+/* Waits up to timeout_ms for watched fds, calling back the ready ones */
+static void _async_wait(async_loop_t* loop, int timeout_ms)
+{
+#if defined(__linux__)
+    struct epoll_event events[ASYNC_MAX_EVENTS];
+    async_watch_t watch;
+    uint32_t index;
+    int count = epoll_wait(loop->epoll_fd, events, ASYNC_MAX_EVENTS, timeout_ms);
+    int ready;
+    int ii;
+    for(ii=0; ii<count; ++ii) {
+        /* A callback may remove a watch whose event is still pending here, or
+         * reuse its slot for another fd */
+        index = (uint32_t)events[ii].data.u64;
+        if(index >= (uint32_t)loop->num_watches)
+            continue;
+        watch = loop->watches[index];
+        if(watch.test == NULL || watch.test->done || (uint32_t)watch.fd != (uint32_t)(events[ii].data.u64 >> 32))
+            continue;
+        ready = 0;
+        if(events[ii].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ready |= UT_READABLE;
+        if(events[ii].events & (EPOLLOUT | EPOLLERR))
+            ready |= UT_WRITABLE;
+        _async_call_io(&watch, (ready & watch.events) ? (ready & watch.events) : watch.events);
+    }
+#elif !defined(_WIN32)
+    struct pollfd* fds = (struct pollfd*)calloc((size_t)(loop->num_watches + 1), sizeof(*fds));
+    int* indices = (int*)calloc((size_t)(loop->num_watches + 1), sizeof(*indices));
+    async_watch_t watch;
+    int count = 0;
+    int ready;
+    int ii;
+    for(ii=0; fds && indices && ii<loop->num_watches; ++ii) {
+        if(loop->watches[ii].test == NULL)
+            continue;
+        fds[count].fd = loop->watches[ii].fd;
+        fds[count].events = (short)(((loop->watches[ii].events & UT_READABLE) ? POLLIN : 0) |
+                                    ((loop->watches[ii].events & UT_WRITABLE) ? POLLOUT : 0));
+        indices[count++] = ii;
+    }
+    if(poll(fds, (nfds_t)count, timeout_ms) > 0) {
+        for(ii=0; ii<count; ++ii) {
+            watch = loop->watches[indices[ii]];
+            if(fds[ii].revents == 0 || watch.test == NULL || watch.test->done || watch.fd != fds[ii].fd)
+                continue;
+            ready = 0;
+            if(fds[ii].revents & (POLLIN | POLLHUP | POLLERR))
+                ready |= UT_READABLE;
+            if(fds[ii].revents & (POLLOUT | POLLERR))
+                ready |= UT_WRITABLE;
+            _async_call_io(&watch, (ready & watch.events) ? (ready & watch.events) : watch.events);
+        }
+    }
+    free(fds);
+    free(indices);
+#else
+    (void)sizeof(loop);
+    if(timeout_ms)
+        Sleep((DWORD)timeout_ms);
+#endif
+}
+static void _async_run_timers(async_loop_t* loop, uint64_t now)
+{
+    test_context_t* previous = NULL;
+    async_timer_t timer;
+    int ii;
+    /* Timers added by the callbacks may move the array */
+    for(ii=0; ii<loop->num_timers; ++ii) {
+        timer = loop->timers[ii];
+        if(timer.test == NULL || timer.when > now)
+            continue;
+        loop->timers[ii].test = NULL;
+        if(timer.test->done)
+            continue;
+        previous = _async_enter(timer.test);
+        timer.func(timer.test, timer.data);
+        _thread_context = previous;
+    }
+}
+static void _finish_async_test(ut_async_t* test, test_context_t* into)
+{
+    async_loop_t* loop = test->loop;
+    int ii;
+    test->finished = 1;
+    _leave_active_context(&test->context, loop->outer_context);
+    for(ii=0; ii<loop->num_watches; ++ii) {
+        if(loop->watches[ii].test == test)
+            _async_remove_watch(loop, loop->watches + ii);
+    }
+    for(ii=0; ii<loop->num_timers; ++ii) {
+        if(loop->timers[ii].test == test)
+            loop->timers[ii].test = NULL;
+    }
+    if(into) {
+        test->context.name = into->name;
+        *into = test->context;
+    } else {
+        _report_test(&test->context, test->record, ut_now_ns() - test->start);
+    }
+}
+static void _run_async_loop(async_loop_t* loop, ut_async_t* tests, int count, test_context_t* into)
+{
+    test_context_t* previous = NULL;
+    uint64_t now, next;
+    int pending = count;
+    int timeout_ms;
+    int ii;
+    while(pending) {
+        now = ut_now_ns();
+        next = (uint64_t)-1;
+        for(ii=0; ii<count; ++ii) {
+            ut_async_t* test = tests + ii;
+            if(test->finished)
+                continue;
+            if(!test->done && now >= test->deadline) {
+                previous = _async_enter(test);
+                _fail(test->file, test->line, "%s timed out after %.0fms without calling ut_done",
+                      test->context.name, (double)(now - test->start) / 1e6);
+                _thread_context = previous;
+                test->done = 1;
+            }
+            if(test->done) {
+                _finish_async_test(test, into);
+                pending--;
+            } else if(test->deadline < next) {
+                next = test->deadline;
+            }
+        }
+        if(pending == 0)
+            break;
+        for(ii=0; ii<loop->num_timers; ++ii) {
+            if(loop->timers[ii].test && loop->timers[ii].when < next)
+                next = loop->timers[ii].when;
+        }
+        if(next <= now)
+            timeout_ms = 0;
+        else if(next - now > 3600000000000u)
+            timeout_ms = 3600000;
+        else
+            timeout_ms = (int)((next - now + 999999) / 1000000);
+        _async_wait(loop, timeout_ms);
+        _async_run_timers(loop, ut_now_ns());
+    }
+}
+/* Runs the selected async tests among entries. When into is given the
+ * result goes there instead of being reported; repeat mode runs one test
+ * at a time that way.
+ */
+static void _run_async_tests(const test_entry_t* entries, int num_entries, test_context_t* into)
+{
+    async_loop_t loop;
+    test_context_t* previous = NULL;
+    ut_async_t* tests = NULL;
+    ut_async_t* test = NULL;
+    int count = 0;
+    int error = 0;
+    int ii;
+
+    for(ii=0; ii<num_entries; ++ii)
+        count += entries[ii].async_func && entries[ii].selected;
+    if(count == 0)
+        return;
+    tests = (ut_async_t*)calloc((size_t)count, sizeof(*tests));
+    if(tests == NULL)
+        return;
+    memset(&loop, 0, sizeof(loop));
+    loop.outer_context = _active_context;
+#ifdef __linux__
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop.epoll_fd < 0)
+        error = errno;
+#endif
+
+    count = 0;
+    for(ii=0; ii<num_entries; ++ii) {
+        if(!entries[ii].async_func || !entries[ii].selected)
+            continue;
+        test = tests + count++;
+        test->loop = &loop;
+        test->func = entries[ii].async_func;
+        test->file = entries[ii].file;
+        test->line = entries[ii].line;
+        if(into) {
+            test->context = *into;
+        } else {
+            _reset_context(&test->context);
+            test->context.seed = _seed;
+        }
+        test->context.name = entries[ii].name;
+        test->record = into ? -1 : _journal_begin(entries[ii].name);
+        test->start = ut_now_ns();
+        test->deadline = test->start + (uint64_t)_test_timeout_ms * 1000000u;
+        previous = _async_enter(test);
+        if(error) {
+            /* Nothing would ever call back, so fail instead of waiting */
+            _fail(test->file, test->line, "Could not create the async test loop: %s", strerror(error));
+            test->done = 1;
+        } else {
+            test->func(test);
+        }
+        _thread_context = previous;
+    }
+    _run_async_loop(&loop, tests, count, into);
+    /* Tests in flight share the arena, so it is released once they all finish */
+    _arena_reset(&_arena);
+
+#ifdef __linux__
+    if(loop.epoll_fd >= 0)
+        close(loop.epoll_fd);
+#endif
+    free(loop.watches);
+    free(loop.timers);
+    free(tests);
+}
+
+/* Repeat mode
+ *  --repeat and --until-fail run the selected tests many times in one
+ *  process. By default the iterations run one at a time; --jobs N spreads
+ *  them over N worker threads (0 for one per CPU), each with its own context
+ *  and Lua state, so a test repeated in parallel must not share mutable
+ *  state between runs, and checks on threads it starts itself fail the run
+ *  without pointing at it. Tests take turns in chunks so --until-fail
+ *  reaches every test early. Each iteration gets its own seed (ut_seed) and
+ *  only the first failing iteration of a test reports its messages.
+ */
+typedef struct {
+    const test_entry_t* entry;      /**< NULL for Lua tests */
+    const char*         lua_file;
+    const char*         lua_path;
+    int                 failure_gate;
+    repeat_stats_t      stats;
+} repeat_test_t;
+
+typedef struct {
+    repeat_test_t*  tests;
+    int             num_tests;
+    int             capacity;
+    string_list_t   strings;
+    repeat_test_t*  test;
+    barrier_t       barrier;
+    mutex_t         lock;
+    char            cwd[1024];
+    uint32_t        seed;
+    int             next_iteration;
+    int             end_iteration;
+    int             until_fail;
+    int             failed;
+    int             stop;
+} repeat_t;
+
+typedef struct {
+    repeat_t*       repeat;
+    thread_t        thread;
+    test_context_t  context;
+#if LUA_TESTS
+    lua_State*      L;
+#endif
+} repeat_worker_t;
+
+static int  _repeat_count = 0;
+static int  _until_fail = 0;
+static int  _num_jobs = 1;
+static volatile sig_atomic_t _interrupted = 0;
+
+static void _on_interrupt(int signum)
+{
+    _interrupted = 1;
+    (void)sizeof(signum);
+}
+static int _num_cpus(void)
+{
+#ifndef _WIN32
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#else
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#endif
+}
+static uint32_t _iteration_seed(uint32_t seed, int iteration)
+{
+    /* Iteration 0 runs with the base seed, so --seed reproduces any of them */
+    return seed + (uint32_t)iteration * 0x9E3779B9u;
+}
+static void _add_repeat_test(repeat_t* repeat, const test_entry_t* entry, const char* name,
+                             const char* lua_file, const char* lua_path)
+{
+    repeat_test_t* test = NULL;
+    if(name == NULL)
+        return;
+    if(repeat->num_tests == repeat->capacity) {
+        int capacity = repeat->capacity ? repeat->capacity * 2 : 64;
+        test = (repeat_test_t*)realloc(repeat->tests, (size_t)capacity * sizeof(*test));
+        if(test == NULL)
+            return;
+        repeat->tests = test;
+        repeat->capacity = capacity;
+    }
+    test = repeat->tests + repeat->num_tests++;
+    memset(test, 0, sizeof(*test));
+    test->entry = entry;
+    test->lua_file = lua_file;
+    test->lua_path = lua_path;
+    test->stats.name = name;
+    test->stats.file = entry ? entry->file : lua_file;
+    test->stats.first_failure = -1;
+}
+#if LUA_TESTS
+static const char* _repeat_string(repeat_t* repeat, const char* str)
+{
+    int count = repeat->strings.count;
+    _string_list_add(&repeat->strings, str, strlen(str));
+    return repeat->strings.count > count ? repeat->strings.strings[count] : NULL;
+}
+static void _add_lua_repeat_tests(repeat_t* repeat, lua_State* L)
+{
+    string_list_t files = {NULL, 0, 0};
+    const char* file = NULL;
+    const char* path = NULL;
+    int ii, jj;
+    _list_lua_files(&files);
+    for(ii=0; ii<files.count; ++ii) {
+        snprintf(_current_lua_test_file, sizeof(_current_lua_test_file), "%s/%s", repeat->cwd, files.strings[ii]);
+        file = _repeat_string(repeat, files.strings[ii]);
+        path = _repeat_string(repeat, _current_lua_test_file);
+        if(file == NULL || path == NULL || !_load_lua_env(L, file))
+            continue;
+        lua_getglobal(L, "_test_names");
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 1);
+        for(jj=1; ; ++jj) {
+            lua_rawgeti(L, -1, jj);
+            if(lua_isnil(L, -1))
+                break;
+            _add_repeat_test(repeat, NULL, _repeat_string(repeat, lua_tostring(L, -1)), file, path);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 3);
+    }
+    _string_list_free(&files);
+}
+#endif /* LUA_TESTS */
+static void _record_iteration(repeat_test_t* test, const test_context_t* context, int iteration, uint64_t duration)
+{
+    repeat_stats_t* stats = &test->stats;
+    if(stats->iterations == 0 || duration < stats->min_ns)
+        stats->min_ns = duration;
+    if(duration > stats->max_ns)
+        stats->max_ns = duration;
+    stats->iterations++;
+    stats->sum_ns += (double)duration;
+    stats->sum_squares_ns += (double)duration * (double)duration;
+    if(context->result == kResultIgnore)
+        stats->ignored++;
+    if(context->result != kResultFail)
+        return;
+    stats->failures++;
+    if(stats->first_failure < 0 || iteration < stats->first_failure) {
+        stats->first_failure = iteration;
+        stats->first_failure_seed = context->seed;
+        /* Lua failures point into the worker's thread-local file name */
+        stats->failure_file = test->lua_path ? test->lua_path : context->failure_file;
+        stats->failure_line = context->failure_line;
+    }
+}
+static void _run_repeat_test(repeat_worker_t* worker, repeat_test_t* test)
+{
+#if LUA_TESTS
+    if(test->lua_file) {
+        if(strstr(test->stats.name, "Ignore_")) {
+            _ignore_test();
+            return;
+        }
+        if(worker->L == NULL)
+            worker->L = _create_lua_state();
+        _run_lua_test(worker->L, worker->repeat->cwd, test->lua_file, test->stats.name);
+        return;
+    }
+#else
+    (void)sizeof(worker);
+#endif
+    if(test->entry->async_func)
+        _run_async_tests(test->entry, 1, _current_context());
+    else
+        test->entry->func();
+}
+static void _run_iterations(repeat_worker_t* worker)
+{
+    repeat_t* repeat = worker->repeat;
+    repeat_test_t* test = repeat->test;
+    test_context_t* context = &worker->context;
+    uint64_t start;
+    int iteration;
+    for(;;) {
+        _mutex_lock(&repeat->lock);
+        iteration = repeat->next_iteration < repeat->end_iteration ? repeat->next_iteration++ : -1;
+        _mutex_unlock(&repeat->lock);
+        if(iteration < 0)
+            break;
+        _reset_context(context);
+        context->name = test->stats.name;
+        context->seed = _iteration_seed(repeat->seed, iteration);
+        context->failure_gate = &test->failure_gate;
+        start = ut_now_ns();
+        _run_repeat_test(worker, test);
+        start = ut_now_ns() - start;
+        _mutex_lock(&repeat->lock);
+        _record_iteration(test, context, iteration, start);
+        if(context->result == kResultFail && repeat->until_fail) {
+            /* Stop handing out iterations; the ones in flight still finish */
+            repeat->failed = 1;
+            repeat->end_iteration = repeat->next_iteration;
+        }
+        _mutex_unlock(&repeat->lock);
+        _arena_reset(&_arena);
+    }
+}
+static THREAD_FUNC(_repeat_thread, arg)
+{
+    repeat_worker_t* worker = (repeat_worker_t*)arg;
+    repeat_t* repeat = worker->repeat;
+    _thread_context = &worker->context;
+    for(;;) {
+        _barrier_wait(&repeat->barrier);
+        if(repeat->stop)
+            break;
+        _run_iterations(worker);
+        _barrier_wait(&repeat->barrier);
+    }
+#if LUA_TESTS
+    if(worker->L)
+        lua_close(worker->L);
+#endif
+    _arena_free(&_arena);
+    _thread_context = NULL;
+    return THREAD_RETURN;
+}
+static void _report_repeated(const repeat_t* repeat)
+{
+    test_context_t context = {NULL, kResultPass, 0, NULL, 0, 0, NULL, 0, NULL, NULL, NULL, NULL};
+    const repeat_stats_t* stats = NULL;
+    int ii;
+    for(ii=0; ii<repeat->num_tests; ++ii) {
+        stats = &repeat->tests[ii].stats;
+        if(stats->iterations == 0)
+            continue;
+        _reset_context(&context);
+        context.name = stats->name;
+        context.num_failures = stats->failures;
+        context.failure_file = stats->failure_file;
+        context.failure_line = stats->failure_line;
+        if(stats->failures)
+            context.result = kResultFail;
+        else if(stats->ignored == stats->iterations)
+            context.result = kResultIgnore;
+        _report_test(&context, _journal_begin(stats->name), (uint64_t)_repeat_mean_ns(stats));
+    }
+    for(ii=0; ii<repeat->num_tests; ++ii) {
+        stats = &repeat->tests[ii].stats;
+        if(stats->iterations == 0 || stats->ignored == stats->iterations)
+            continue;
+        _mutex_lock(&_output_lock);
+        _reporter->test_repeated(stats);
+        _mutex_unlock(&_output_lock);
+    }
+}
+static void _run_repeated(void)
 {
-    _check_not_null(_current_lua_test_file, _lua_line(L), lua_topointer(L, 1));
-    return 0;
+    repeat_t repeat;
+    repeat_worker_t* workers = NULL;
+    int num_workers = _num_jobs > 0 ? _num_jobs : _num_cpus();
+    int limit = _repeat_count > 0 ? _repeat_count : INT_MAX;
+    int num_started = 0;
+    int remaining = 0;
+    int count;
+    int ii;
+
+    memset(&repeat, 0, sizeof(repeat));
+    if(getcwd(repeat.cwd, sizeof(repeat.cwd)) == NULL)
+        perror("Could not get current working directory");
+    repeat.seed = _seed;
+    repeat.until_fail = _until_fail;
+    for(ii=0; ii<_num_tests; ++ii) {
+        if(_tests[ii].selected)
+            _add_repeat_test(&repeat, _tests + ii, _tests[ii].name, NULL, NULL);
+    }
+#if LUA_TESTS
+    _add_lua_repeat_tests(&repeat, _L);
+#endif
+
+    workers = (repeat_worker_t*)calloc((size_t)num_workers, sizeof(*workers));
+    if(workers == NULL) {
+        _report_note("Could not allocate %d repeat threads\n", num_workers);
+        num_workers = 0;
+    }
+    _mutex_init(&repeat.lock);
+    _mutex_init(&repeat.barrier.lock);
+    _cond_init(&repeat.barrier.cond);
+    repeat.barrier.total = num_workers + 1;
+    for(ii=0; ii<num_workers; ++ii) {
+        workers[ii].repeat = &repeat;
+        if(_thread_create(&workers[ii].thread, &_repeat_thread, &workers[ii]) != 0)
+            break;
+        num_started++;
+    }
+    if(num_started < num_workers) {
+        _mutex_lock(&repeat.barrier.lock);
+        repeat.barrier.total = num_started + 1;
+        _mutex_unlock(&repeat.barrier.lock);
+    }
+
+    /* Threads a test starts itself can only be traced to it on one worker */
+    _active_context = num_started == 1 ? &workers[0].context : NULL;
+    if(num_started) {
+        if(!_quiet)
+            _report_note("Repeating %d tests on %d threads, seed %lu\n",
+                         repeat.num_tests, num_started, (unsigned long)repeat.seed);
+        signal(SIGINT, &_on_interrupt);
+        do {
+            remaining = 0;
+            for(ii=0; ii<repeat.num_tests && !repeat.failed && !_interrupted; ++ii) {
+                repeat_test_t* test = repeat.tests + ii;
+                count = limit - test->stats.iterations;
+                if(count <= 0 || test->stats.ignored)
+                    continue;
+                if(count > REPEAT_CHUNK)
+                    count = REPEAT_CHUNK;
+                repeat.test = test;
+                repeat.next_iteration = test->stats.iterations;
+                repeat.end_iteration = repeat.next_iteration + count;
+                _barrier_wait(&repeat.barrier);
+                _barrier_wait(&repeat.barrier);
+                remaining |= test->stats.iterations < limit;
+            }
+        } while(remaining && !repeat.failed && !_interrupted);
+        signal(SIGINT, SIG_DFL);
+        if(_interrupted && !_quiet)
+            _report_note("Interrupted\n");
+    }
+    repeat.stop = 1;
+    _barrier_wait(&repeat.barrier);
+    for(ii=0; ii<num_started; ++ii)
+        _thread_join(workers[ii].thread);
+    _active_context = &_main_context;
+
+    _report_repeated(&repeat);
+    if(_stray_context.num_failures)
+        _report_note("%d checks failed on threads the tests started themselves, which --jobs %d "
+                     "cannot tell apart; run with --jobs 1 to find the test\n",
+                     _stray_context.num_failures, num_started);
+    _cond_destroy(&repeat.barrier.cond);
+    _mutex_destroy(&repeat.barrier.lock);
+    _mutex_destroy(&repeat.lock);
+    _string_list_free(&repeat.strings);
+    free(repeat.tests);
+    free(workers);
 }
-static int _check_equal_pointer_l(lua_State* L)
+
+/* Watch mode
+ *  Keeps the process alive after the first run. Lua files that change are
+ *  re-run in the warm Lua state; when the test binary itself is rebuilt the
+ *  process re-executes it.
+ */
+static int _watch = 0;
+
+static void _add_changed_lua_file(string_list_t* changed, const char* name)
 {
-    _check_equal_pointer(_current_lua_test_file, _lua_line(L), lua_topointer(L, 1), lua_topointer(L, 2));
-    return 0;
+#if LUA_TESTS
+    int ii;
+    if(!_is_lua_test_file(name))
+        return;
+    for(ii=0; ii<changed->count; ++ii) {
+        if(strcmp(changed->strings[ii], name) == 0)
+            return;
+    }
+    _string_list_add(changed, name, strlen(name));
+#else
+    (void)sizeof(changed);
+    (void)sizeof(name);
+#endif
 }
-static int _check_not_equal_pointer_l(lua_State* L)
+static void _rerun_lua_files(const char* cwd, const string_list_t* changed)
 {
-    _check_not_equal_pointer(_current_lua_test_file, _lua_line(L), lua_topointer(L, 1), lua_topointer(L, 2));
-    return 0;
+#if LUA_TESTS
+    int ii;
+    for(ii=0; ii<changed->count; ++ii)
+        _run_lua_file(_L, cwd, changed->strings[ii]);
+#else
+    (void)sizeof(cwd);
+    (void)sizeof(changed);
+#endif
 }
 
-static int _check_equal_float_l(lua_State* L)
+static void _watch_for_changes(int argc, const char* argv[])
 {
-    _check_equal_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
-    return 0;
+#ifdef __linux__
+    union {
+        struct inotify_event    event;
+        char                    data[4096];
+    } events;
+    char exe_path[1024];
+    char exe_dir[1024];
+    char cwd[1024] = {0};
+    const char* exe_name = NULL;
+    string_list_t changed = {NULL, 0, 0};
+    struct pollfd watch;
+    char** args = NULL;
+    int exe_changed = 0;
+    int dir_watch = -1;
+    int exe_watch = -1;
+    ssize_t length = 0;
+
+    watch.fd = inotify_init1(IN_CLOEXEC);
+    watch.events = POLLIN;
+    length = readlink("/proc/self/exe", exe_path, sizeof(exe_path)-1);
+    if(watch.fd < 0 || length <= 0 || getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("Could not watch for changes");
+        return;
+    }
+    exe_path[length] = '\0';
+    exe_name = strrchr(exe_path, '/') + 1;
+    snprintf(exe_dir, sizeof(exe_dir), "%.*s", (int)(exe_name - exe_path), exe_path);
+    dir_watch = inotify_add_watch(watch.fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+    exe_watch = inotify_add_watch(watch.fd, exe_dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+    if(!_quiet)
+        _report_note("Watching %s for changes\n", cwd);
+    _output_flush();
+    for(;;) {
+        /* Wait until the files have been quiet for a moment so an editor's
+         * or linker's burst of writes triggers one run */
+        int ready = poll(&watch, 1, (changed.count || exe_changed) ? WATCH_SETTLE_MS : -1);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready < 0)
+            break;
+        if(ready > 0) {
+            char* event = events.data;
+            length = read(watch.fd, events.data, sizeof(events.data));
+            while(length > 0 && event < events.data + length) {
+                const struct inotify_event* current = (const struct inotify_event*)(void*)event;
+                event += sizeof(struct inotify_event) + current->len;
+                if(current->len == 0)
+                    continue;
+                if(current->wd == exe_watch && strcmp(current->name, exe_name) == 0)
+                    exe_changed = 1;
+                if(current->wd == dir_watch)
+                    _add_changed_lua_file(&changed, current->name);
+            }
+            continue;
+        }
+
+        if(exe_changed) {
+            if(!_quiet)
+                _report_note("%s was rebuilt, restarting\n", exe_name);
+            _output_flush();
+            _journal_close();
+            close(watch.fd);
+            /* run_all_tests doesn't promise argv[argc] is NULL; execv needs it */
+            args = (char**)calloc((size_t)argc + 1, sizeof(char*));
+            if(args) {
+                memcpy(args, argv, (size_t)argc * sizeof(char*));
+                execv(exe_path, args);
+                free(args);
+            }
+            perror("Could not restart");
+            return;
+        }
+        _num_tests_failed = _num_tests_passed = _num_tests_ignored = 0;
+        _reporter->begin_run();
+        _rerun_lua_files(cwd, &changed);
+        _reporter->end_run(_num_tests_failed, _num_tests_passed, _num_tests_ignored,
+                           _num_tests_failed + _num_tests_passed + _num_tests_ignored);
+        _output_flush();
+        _string_list_free(&changed);
+    }
+    close(watch.fd);
+#else
+    _report_note("--watch is only supported on Linux\n");
+    (void)sizeof(argc);
+    (void)sizeof(argv);
+#endif
 }
-static int _check_not_equal_float_l(lua_State* L)
+
+/* Driver mode
+ *  --driver lets an external scheduler feed a warm process work, reading
+ *  commands from stdin or, with --driver-socket, from one connection at a
+ *  time on a Unix socket. Commands are lines of words:
+ *      list            an info event per test with its id, then end
+ *      run ID          runs a test by id or name
+ *      batch ID...     runs several tests
+ *      shutdown        answers shutdown and returns from run_all_tests
+ *  Answers are JSON lines, the events of --reporter json. run and batch
+ *  answer begin, then for each test a start event with its id, its failures
+ *  and its test event, then end with the counts. In stdin mode the answers
+ *  keep the original stdout; anything the tests print goes to stderr.
+ */
+static int          _driver_mode = 0;
+static const char*  _driver_socket = NULL;
+static int          _driver_failed = 0;
+
+static int _read_line(FILE* input, buffer_t* line)
 {
-    _check_not_equal_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
-    return 0;
+    char c;
+    int next;
+    line->size = 0;
+    _buffer_append(line, "", 0);
+    while((next = getc(input)) != EOF && next != '\n') {
+        c = (char)next;
+        if(c != '\r')
+            _buffer_append(line, &c, 1);
+    }
+    return next != EOF || line->size > 0;
 }
-static int _check_less_than_float_l(lua_State* L)
+static int _driver_find_test(const repeat_t* tests, const char* token)
 {
-    _check_less_than_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
-    return 0;
+    char* end = NULL;
+    long id = strtol(token, &end, 10);
+    int ii;
+    if(end != token && *end == '\0')
+        return id >= 0 && id < tests->num_tests ? (int)id : -1;
+    for(ii=0; ii<tests->num_tests; ++ii)
+        if(strcmp(tests->tests[ii].stats.name, token) == 0)
+            return ii;
+    return -1;
 }
-static int _check_greater_than_float_l(lua_State* L)
+static void _driver_error(const char* message, const char* subject)
 {
-    _check_greater_than_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
-    return 0;
+    _buffer_puts(&_output, "{\"event\":\"error\",\"message\":");
+    _buffer_put_json(&_output, message);
+    _buffer_puts(&_output, ",\"subject\":");
+    _buffer_put_json(&_output, subject);
+    _buffer_puts(&_output, "}\n");
 }
-static int _check_less_than_equal_float_l(lua_State* L)
+static void _driver_list(const repeat_t* tests)
 {
-    _check_less_than_equal_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
-    return 0;
+    const repeat_test_t* test = NULL;
+    int ii;
+    for(ii=0; ii<tests->num_tests; ++ii) {
+        test = tests->tests + ii;
+        _buffer_printf(&_output, "{\"event\":\"info\",\"id\":%d,\"name\":", ii);
+        _buffer_put_json(&_output, test->stats.name);
+        _buffer_puts(&_output, ",\"file\":");
+        _buffer_put_json(&_output, test->entry ? test->entry->file : test->lua_file);
+        _buffer_printf(&_output, ",\"kind\":\"%s\"}\n",
+                       test->entry == NULL ? "lua" : test->entry->async_func ? "async" : "c");
+        _output_check_flush();
+    }
+    _buffer_printf(&_output, "{\"event\":\"end\",\"total\":%d}\n", tests->num_tests);
 }
-static int _check_greater_than_equal_float_l(lua_State* L)
+static void _driver_run_test(repeat_t* tests, int id)
 {
-    _check_greater_than_equal_float(_current_lua_test_file, _lua_line(L), lua_tonumber(L, 1), lua_tonumber(L, 2));
-    return 0;
+    repeat_test_t* test = tests->tests + id;
+    _buffer_printf(&_output, "{\"event\":\"start\",\"id\":%d,\"name\":", id);
+    _buffer_put_json(&_output, test->stats.name);
+    _buffer_puts(&_output, "}\n");
+    if(test->entry && test->entry->async_func) {
+        _run_async_tests(test->entry, 1, NULL);
+        return;
+    }
+    _start_test(test->stats.name);
+    if(test->entry)
+        test->entry->func();
+#if LUA_TESTS
+    else if(strstr(test->stats.name, "Ignore_"))
+        _ignore_test();
+    else
+        _run_lua_test(_L, tests->cwd, test->lua_file, test->stats.name);
+#endif
+    _finish_test();
 }
-
-static int _check_equal_string_l(lua_State* L)
+/* Returns 0 once the scheduler asked to shut down */
+static int _driver_command(repeat_t* tests, char* line)
 {
-    _check_equal_string(_current_lua_test_file, _lua_line(L), lua_tolstring(L, (1), ((void*)0)), lua_tolstring(L, (2), ((void*)0)));
-    return 0;
+    char* command = strtok(line, " \t");
+    char* token = NULL;
+    int id;
+    if(command == NULL)
+        return 1;
+    if(strcmp(command, "list") == 0) {
+        _driver_list(tests);
+    } else if(strcmp(command, "run") == 0 || strcmp(command, "batch") == 0) {
+        _num_tests_failed = _num_tests_passed = _num_tests_ignored = 0;
+        _reporter->begin_run();
+        while((token = strtok(NULL, " \t")) != NULL) {
+            id = _driver_find_test(tests, token);
+            if(id < 0)
+                _driver_error("unknown test", token);
+            else
+                _driver_run_test(tests, id);
+        }
+        _reporter->end_run(_num_tests_failed, _num_tests_passed, _num_tests_ignored,
+                           _num_tests_failed + _num_tests_passed + _num_tests_ignored);
+        _driver_failed += _num_tests_failed;
+    } else if(strcmp(command, "shutdown") == 0) {
+        _buffer_puts(&_output, "{\"event\":\"shutdown\"}\n");
+        return 0;
+    } else {
+        _driver_error("unknown command", command);
+    }
+    return 1;
 }
-static int _check_not_equal_string_l(lua_State* L)
+static int _driver_serve(repeat_t* tests, FILE* input)
 {
-    _check_not_equal_string(_current_lua_test_file, _lua_line(L), lua_tolstring(L, (1), ((void*)0)), lua_tolstring(L, (2), ((void*)0)));
-    return 0;
+    buffer_t line = {NULL, 0, 0};
+    int running = 1;
+    while(running && _read_line(input, &line)) {
+        running = _driver_command(tests, line.data);
+        _output_flush();
+    }
+    _buffer_free(&line);
+    return running;
 }
-static luaL_Reg _lua_test_methods[] = {
-    { "FAIL", _FAIL_l },
-    { "CHECK_TRUE", _check_true_l },
-    { "CHECK_FALSE", _check_false_l },
-
-    { "CHECK_EQUAL", _check_equal_l },
-    { "CHECK_NOT_EQUAL", _check_not_equal_l },
-    { "CHECK_LESS_THAN", _check_less_than_l },
-    { "CHECK_GREATER_THAN", _check_greater_than_l },
-    { "CHECK_LESS_THAN_EQUAL", _check_less_than_equal_l },
-    { "CHECK_GREATER_THAN_EQUAL", _check_greater_than_equal_l },
-
-    { "CHECK_NULL", _check_null_l },
-    { "CHECK_NOT_NULL", _check_not_null_l },
-    { "CHECK_EQUAL_POINTER", _check_equal_pointer_l },
-    { "CHECK_NOT_EQUAL_POINTER", _check_not_equal_pointer_l },
-
-    { "CHECK_EQUAL_FLOAT", _check_equal_float_l },
-    { "CHECK_NOT_EQUAL_FLOAT", _check_not_equal_float_l },
-    { "CHECK_LESS_THAN_FLOAT", _check_less_than_float_l },
-    { "CHECK_GREATER_THAN_FLOAT", _check_greater_than_float_l },
-    { "CHECK_LESS_THAN_EQUAL_FLOAT", _check_less_than_equal_float_l },
-    { "CHECK_GREATER_THAN_EQUAL_FLOAT", _check_greater_than_equal_float_l },
-
-    { "CHECK_EQUAL_STRING", _check_equal_string_l },
-    { "CHECK_NOT_EQUAL_STRING", _check_not_equal_string_l },
-    { NULL, NULL },
-};
-static int _count_lua_test(lua_State* L)
+#ifndef _WIN32
+static void _driver_listen(repeat_t* tests)
 {
-    _num_tests++;
-    switch(_current_result)
-    {
-    case kResultPass: _num_tests_passed++; printf("."); break;
-    case kResultFail: _num_tests_failed++; break;
-    case kResultIgnore: _num_tests_ignored++; printf("!"); break;
+    struct sockaddr_un address;
+    FILE* input = NULL;
+    FILE* output = NULL;
+    int server = -1;
+    int connection = -1;
+    int running = 1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(_driver_socket) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", _driver_socket);
+        return;
     }
-    _current_result = kResultPass;
-    return 0;
-    (void)sizeof(L);
+    strcpy(address.sun_path, _driver_socket);
+    unlink(_driver_socket);
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0 || bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server, 1) != 0) {
+        perror(_driver_socket);
+        if(server >= 0)
+            close(server);
+        return;
+    }
+    /* A scheduler that hangs up must not take the process with it */
+    signal(SIGPIPE, SIG_IGN);
+    while(running && (connection = accept(server, NULL, NULL)) >= 0) {
+        input = fdopen(connection, "r");
+        output = input ? fdopen(dup(connection), "w") : NULL;
+        if(output) {
+            _output_file = output;
+            running = _driver_serve(tests, input);
+            _output_flush();
+            _output_file = NULL;
+            fclose(output);
+        }
+        if(input)
+            fclose(input);
+        else
+            close(connection);
+    }
+    close(server);
+    unlink(_driver_socket);
 }
-static int _ignore_lua_test(lua_State* L)
+#endif
+static void _run_driver(void)
 {
-    _ignore_test();
-    return 0;
-    (void)sizeof(L);
+    repeat_t tests;
+    FILE* protocol = NULL;
+    int ii;
+    memset(&tests, 0, sizeof(tests));
+    if(getcwd(tests.cwd, sizeof(tests.cwd)) == NULL)
+        perror("Could not get current working directory");
+    for(ii=0; ii<_num_tests; ++ii) {
+        if(_tests[ii].selected)
+            _add_repeat_test(&tests, _tests + ii, _tests[ii].name, NULL, NULL);
+    }
+#if LUA_TESTS
+    _add_lua_repeat_tests(&tests, _L);
+#endif
+    _output_flush();
+#ifndef _WIN32
+    if(_driver_socket) {
+        _driver_listen(&tests);
+    } else {
+        /* Whatever stdio still holds belongs before the answers */
+        fflush(stdout);
+        protocol = fdopen(dup(STDOUT_FILENO), "w");
+        if(protocol && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0)
+            _output_file = protocol;
+        _driver_serve(&tests, stdin);
+        _output_flush();
+        _output_file = NULL;
+        if(protocol)
+            fclose(protocol);
+    }
+#else
+    (void)sizeof(protocol);
+    _driver_serve(&tests, stdin);
+#endif
+    _num_tests_failed = _driver_failed;
+    free(tests.tests);
+    _string_list_free(&tests.strings);
 }
-#endif /* LUA_TESTS */
 
 /* External functions
  */
 void _fail(const char* file, int line, const char* format, ...)
 {
     va_list args;
-    char buffer[1024];
+    buffer_t message = {NULL, 0, 0};
+    int length;
+    test_context_t* context = _current_context();
+    va_start(args, format);
+    length = vformat_length(format, args);
+    va_end(args);
     va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    _buffer_vprintf(&message, length, format, args);
     va_end(args);
-    printf("\n"ERROR_FORMAT"%s\n", file, line, buffer);
-    _current_result = kResultFail;
+    if(context->failure_hook) {
+        context->failure_hook(file, line, message.data ? message.data : format, context->failure_data);
+        _buffer_free(&message);
+        return;
+    }
+    _mutex_lock(&_output_lock);
+    if(context->num_failures == 0 && context->failure_gate)
+        context->muted = (*context->failure_gate)++ != 0;
+    if(!context->muted)
+        _reporter->failure(context, file, line, message.data ? message.data : format);
+    if(context->num_failures++ == 0) {
+        context->failure_file = file;
+        context->failure_line = line;
+    }
+    context->result = kResultFail;
+    _mutex_unlock(&_output_lock);
+    _buffer_free(&message);
 }
 
 /* bool checks */
@@ -360,133 +3693,540 @@ void _check_greater_than_equal_float(const char* file, int line, double left, do
 /* string checks */
 void _check_equal_string(const char* file, int line, const char* expected, const char* actual)
 {
-    if(strcmp(expected, actual) != 0)
+    if(expected == NULL || actual == NULL) {
+        if(expected != actual)
+            _fail(file,line, "Expected: %s  Actual: %s", expected ? expected : "(null)", actual ? actual : "(null)");
+    } else if(strcmp(expected, actual) != 0)
         _fail(file,line, "Expected: %s  Actual: %s", expected, actual);
 }
 void _check_not_equal_string(const char* file, int line, const char* expected, const char* actual)
 {
-    if(strcmp(expected, actual) == 0)
+    if(expected == NULL || actual == NULL) {
+        if(expected == actual)
+            _fail(file,line, "Strings are equal: (null)");
+    } else if(strcmp(expected, actual) == 0)
         _fail(file,line, "Strings are equal: %s", actual);
 }
 
+/* snapshot checks */
+void _check_matches_snapshot(const char* file, int line, const char* path, const void* buffer, size_t size)
+{
+    mapped_file_t golden;
+    buffer_t diff = {NULL, 0, 0};
+    const char* actual = (const char*)buffer;
+    size_t common = 0;
+    size_t mismatch = 0;
+    if(path == NULL || (actual == NULL && size > 0)) {
+        _fail(file,line, "Invalid snapshot arguments");
+        return;
+    }
+    if(_map_file(path, &golden) != 0) {
+        if(!_update_snapshots)
+            _fail(file,line, "Snapshot not found: %s (run with --update-snapshots to create it)", path);
+        else if(_write_snapshot(path, buffer, size) != 0)
+            _fail(file,line, "Could not write snapshot: %s", path);
+        return;
+    }
+    if(golden.size == size && (size == 0 || memcmp(golden.data, actual, size) == 0)) {
+        _unmap_file(&golden);
+        return;
+    }
+    if(_update_snapshots) {
+        _unmap_file(&golden);
+        if(_write_snapshot(path, buffer, size) != 0)
+            _fail(file,line, "Could not write snapshot: %s", path);
+        else
+            if(!_quiet)
+                _report_note("Updated snapshot: %s\n", path);
+        return;
+    }
+
+    common = golden.size < size ? golden.size : size;
+    mismatch = _find_mismatch(golden.data, actual, common);
+    _fail(file,line, "Snapshot mismatch: %s (expected %lu bytes, actual %lu bytes, first difference at byte %lu)",
+          path, (unsigned long)golden.size, (unsigned long)size, (unsigned long)mismatch);
+    if(_is_binary(golden.data, golden.size) || _is_binary(actual, size)) {
+        _print_hex_window(&diff, '-', golden.data, golden.size, mismatch);
+        _print_hex_window(&diff, '+', actual, size, mismatch);
+    } else {
+        _print_text_diff(&diff, golden.data, golden.size, actual, size, mismatch);
+    }
+    _report_note("%s", diff.data ? diff.data : "");
+    _buffer_free(&diff);
+    _unmap_file(&golden);
+}
 
-int _register_test(test_func_t* func)
+/* stress testing */
+void ut_stress(int num_threads, int num_rounds, ut_stress_func_t* func, void* data, int flags)
 {
-    _test_funcs[_num_tests] = func;
-    return _num_tests++;
+    stress_t stress;
+    stress_worker_t* workers = NULL;
+    int num_started = 0;
+    int failed_round = -1;
+    int failures = 0;
+    int ii;
+
+    if(num_threads <= 0 || num_rounds <= 0 || func == NULL)
+        return;
+    workers = (stress_worker_t*)calloc((size_t)num_threads, sizeof(*workers));
+    if(workers == NULL) {
+        _fail(__FILE__, __LINE__, "Could not allocate %d stress threads", num_threads);
+        return;
+    }
+    memset(&stress, 0, sizeof(stress));
+    stress.func = func;
+    stress.data = data;
+    stress.context = _current_context();
+    stress.flags = flags;
+    stress.seed = ((uint32_t)rand() << 16) ^ (uint32_t)rand() ^ 1u;
+    _mutex_init(&stress.barrier.lock);
+    _cond_init(&stress.barrier.cond);
+    stress.barrier.total = num_threads + 1;
+
+    for(ii=0; ii<num_threads; ++ii) {
+        workers[ii].stress = &stress;
+        workers[ii].index = ii;
+        if(_thread_create(&workers[ii].thread, &_stress_thread, &workers[ii]) != 0)
+            break;
+        num_started++;
+    }
+    if(num_started < num_threads) {
+        _fail(__FILE__, __LINE__, "Could only start %d of %d stress threads", num_started, num_threads);
+        stress.barrier.total = num_started + 1;
+        num_rounds = 0;
+    }
+
+    /* The calling thread is the last one into each barrier, so every worker
+     * is released into the body at the same moment */
+    failures = stress.context->num_failures;
+    for(ii=0; ii<num_rounds; ++ii) {
+        stress.round = ii;
+        _barrier_wait(&stress.barrier);
+        _barrier_wait(&stress.barrier);
+        if(stress.context->num_failures != failures) {
+            failed_round = ii;
+            break;
+        }
+    }
+    stress.stop = 1;
+    _barrier_wait(&stress.barrier);
+    for(ii=0; ii<num_started; ++ii)
+        _thread_join(workers[ii].thread);
+
+    if(failed_round >= 0) {
+        if(flags & UT_STRESS_RANDOM_YIELD)
+            _report_note("  stress: failed in round %d of %d on %d threads (yield seed %lu)\n",
+                         failed_round+1, num_rounds, num_threads, (unsigned long)stress.seed);
+        else
+            _report_note("  stress: failed in round %d of %d on %d threads\n",
+                         failed_round+1, num_rounds, num_threads);
+    }
+    _cond_destroy(&stress.barrier.cond);
+    _mutex_destroy(&stress.barrier.lock);
+    free(workers);
+}
+void ut_stress_yield(void)
+{
+    if(_stress_random && (_xorshift32(&_stress_random) & 1))
+        _thread_yield();
+}
+
+/* histograms */
+void ut_hist_reset(ut_histogram_t* histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
 }
-int __ignore_test(test_func_t* func)
+void ut_hist_record(ut_histogram_t* histogram, uint64_t value)
+{
+    if(histogram->count == 0 || value < histogram->min)
+        histogram->min = value;
+    if(value > histogram->max)
+        histogram->max = value;
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[_hist_index(value)]++;
+}
+void ut_hist_merge(ut_histogram_t* dest, const ut_histogram_t* src)
+{
+    int ii;
+    if(src->count == 0)
+        return;
+    if(dest->count == 0 || src->min < dest->min)
+        dest->min = src->min;
+    if(src->max > dest->max)
+        dest->max = src->max;
+    dest->count += src->count;
+    dest->sum += src->sum;
+    for(ii=0; ii<UT_HIST_BUCKETS; ++ii)
+        dest->buckets[ii] += src->buckets[ii];
+}
+uint64_t ut_hist_percentile(const ut_histogram_t* histogram, double percentile)
+{
+    uint64_t target;
+    uint64_t total = 0;
+    uint64_t value;
+    int ii;
+    if(histogram->count == 0)
+        return 0;
+    if(percentile < 0.0)
+        percentile = 0.0;
+    if(percentile > 100.0)
+        percentile = 100.0;
+    target = (uint64_t)ceil(percentile / 100.0 * (double)histogram->count);
+    if(target == 0)
+        target = 1;
+    for(ii=0; ii<UT_HIST_BUCKETS; ++ii) {
+        total += histogram->buckets[ii];
+        if(total >= target)
+            break;
+    }
+    value = _hist_highest_value(ii);
+    if(value > histogram->max)
+        value = histogram->max;
+    if(value < histogram->min)
+        value = histogram->min;
+    return value;
+}
+uint64_t ut_now_ns(void)
+{
+#ifndef _WIN32
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#else
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if(frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#endif
+}
+void _check_percentile_below(const char* file, int line, const ut_histogram_t* histogram, double percentile, uint64_t limit)
+{
+    uint64_t value;
+    if(histogram->count == 0) {
+        _fail(file,line, "Histogram is empty");
+        return;
+    }
+    value = ut_hist_percentile(histogram, percentile);
+    if(value >= limit) {
+        buffer_t distribution = {NULL, 0, 0};
+        _fail(file,line, "p%g is %"PRIu64", not below %"PRIu64"", percentile, value, limit);
+        _print_histogram(&distribution, histogram);
+        _report_note("%s", distribution.data ? distribution.data : "");
+        _buffer_free(&distribution);
+    }
+}
+
+/* resource budgets
+ *  The first declaration in a test takes the start sample, so tests without
+ *  a budget are never sampled. The tightest budget of each kind is checked
+ *  as the test finishes.
+ */
+static void _declare_budget(budget_t* budget, const char* file, int line, int64_t limit)
+{
+    if(!_budgets_open || _thread_context != NULL)
+        return;
+    if(!_budgets_sampled) {
+        if(_usage_sample(&_budget_start) != 0) {
+            _budgets_open = 0;
+            return;
+        }
+        _budgets_sampled = 1;
+    }
+    if(budget->file == NULL || limit < budget->limit) {
+        budget->file = file;
+        budget->line = line;
+        budget->limit = limit;
+    }
+}
+static void _check_budgets(void)
+{
+    usage_t usage;
+    int64_t growth;
+    int64_t used;
+    _budgets_open = 0;
+    if(!_budgets_sampled || _usage_sample(&usage) != 0)
+        return;
+    growth = usage.rss_bytes - _budget_start.rss_bytes;
+    if(_rss_budget.file && growth > _rss_budget.limit)
+        _fail(_rss_budget.file,_rss_budget.line, "Resident set grew by %"PRId64" bytes, over the budget of %"PRId64"",
+              growth, _rss_budget.limit);
+    used = usage.thread_cpu_ns - _budget_start.thread_cpu_ns;
+    if(_cpu_budget.file && used > _cpu_budget.limit * 1000000)
+        _fail(_cpu_budget.file,_cpu_budget.line, "Used %.1fms of CPU time, over the budget of %"PRId64"ms",
+              (double)used / 1e6, _cpu_budget.limit);
+}
+void _check_max_rss_growth(const char* file, int line, int64_t limit)
+{
+    _declare_budget(&_rss_budget, file, line, limit);
+}
+void _check_max_cpu_ms(const char* file, int line, int64_t limit)
+{
+    _declare_budget(&_cpu_budget, file, line, limit);
+}
+
+
+int _register_test(test_func_t* func, const char* name, const char* file)
 {
-    _test_funcs[_num_tests] = _ignore_test;
+    if(_num_tests == MAX_TESTS) {
+        printf("Too many tests, ignoring %s\n", name);
+        return -1;
+    }
+    _tests[_num_tests].func = func;
+    _tests[_num_tests].name = name;
+    _tests[_num_tests].file = file;
+    _tests[_num_tests].selected = 1;
     return _num_tests++;
+}
+int __ignore_test(test_func_t* func, const char* name, const char* file)
+{
+    return _register_test(&_ignore_test, name, file);
     (void)sizeof(func);
 }
 void _ignore_test(void)
 {
-    _current_result = kResultIgnore;
+    _current_context()->result = kResultIgnore;
+}
+uint32_t ut_seed(void)
+{
+    return _current_context()->seed;
+}
+void ut_set_failure_hook(ut_failure_func_t* func, void* data)
+{
+    test_context_t* context = _current_context();
+    context->failure_hook = func;
+    context->failure_data = func ? data : NULL;
+}
+
+/* scratch memory */
+void* ut_alloc(size_t size)
+{
+    return ut_alloc_aligned(size, ARENA_ALIGNMENT);
+}
+void* ut_alloc_aligned(size_t size, size_t alignment)
+{
+    void* memory = NULL;
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        _fail(__FILE__, __LINE__, "ut_alloc_aligned: alignment %lu is not a power of two", (unsigned long)alignment);
+        return NULL;
+    }
+    memory = _arena_alloc(&_arena, size ? size : 1, alignment);
+    if(memory == NULL)
+        _fail(__FILE__, __LINE__, "ut_alloc could not allocate %lu bytes", (unsigned long)size);
+    return memory;
+}
+char* ut_strdup(const char* str)
+{
+    size_t size;
+    char* copy = NULL;
+    if(str == NULL)
+        return NULL;
+    size = strlen(str) + 1;
+    copy = (char*)ut_alloc_aligned(size, 1);
+    if(copy)
+        memcpy(copy, str, size);
+    return copy;
+}
+
+/* async tests */
+int _register_async_test(async_test_func_t* func, const char* name, const char* file, int line)
+{
+    int index = _register_test(NULL, name, file);
+    if(index >= 0) {
+        _tests[index].async_func = func;
+        _tests[index].line = line;
+    }
+    return index;
+}
+void ut_done(ut_async_t* test)
+{
+    test->done = 1;
+}
+int ut_watch_fd(ut_async_t* test, int fd, int events, ut_io_func_t* func, void* data)
+{
+#ifndef _WIN32
+    async_loop_t* loop = test->loop;
+    async_watch_t* watch = _async_find_watch(loop, fd);
+    int existing = watch != NULL;
+    if(watch == NULL)
+        watch = _async_new_watch(loop);
+    if(watch == NULL) {
+        _fail(__FILE__, __LINE__, "Could not watch fd %d", fd);
+        return -1;
+    }
+    watch->test = test;
+    watch->fd = fd;
+    watch->events = events;
+    watch->func = func;
+    watch->data = data;
+#ifdef __linux__
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = (uint32_t)(((events & UT_READABLE) ? EPOLLIN : 0) | ((events & UT_WRITABLE) ? EPOLLOUT : 0));
+        event.data.u64 = ((uint64_t)(uint32_t)fd << 32) | (uint64_t)(watch - loop->watches);
+        /* A fd closed while watched leaves epoll on its own */
+        if(epoll_ctl(loop->epoll_fd, existing ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) != 0 &&
+           (errno != ENOENT || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)) {
+            _fail(__FILE__, __LINE__, "Could not watch fd %d: %s", fd, strerror(errno));
+            watch->test = NULL;
+            return -1;
+        }
+    }
+#else
+    (void)sizeof(existing);
+#endif
+    return 0;
+#else
+    (void)sizeof(test);
+    (void)sizeof(events);
+    (void)sizeof(func);
+    (void)sizeof(data);
+    _fail(__FILE__, __LINE__, "Cannot watch fd %d, ut_watch_fd is not supported on Windows", fd);
+    return -1;
+#endif
+}
+void ut_unwatch_fd(ut_async_t* test, int fd)
+{
+    async_watch_t* watch = _async_find_watch(test->loop, fd);
+    if(watch && watch->test == test)
+        _async_remove_watch(test->loop, watch);
+}
+void ut_after(ut_async_t* test, int ms, ut_timer_func_t* func, void* data)
+{
+    async_loop_t* loop = test->loop;
+    async_timer_t* timer = _async_new_timer(loop);
+    if(timer == NULL) {
+        _fail(__FILE__, __LINE__, "Could not allocate a timer");
+        return;
+    }
+    timer->test = test;
+    timer->when = ut_now_ns() + (uint64_t)(ms > 0 ? ms : 0) * 1000000u;
+    timer->func = func;
+    timer->data = data;
+}
+void ut_set_timeout(ut_async_t* test, int ms)
+{
+    test->deadline = test->start + (uint64_t)(ms > 0 ? ms : 0) * 1000000u;
 }
 
 int run_all_tests(int argc, const char* argv[])
 {
+    int usage_error = 0;
     int ii;
-    /* Create Lua state */
-    #if LUA_TESTS
-        const char script[] =
-        "function run_tests()\n"\
-        "    for key, val in pairs(_G) do\n"\
-        "        if \"function\" == type(val) then\n"\
-        "            if string.find(key, \"_Test\") then\n"\
-        "                if string.find(key, \"Ignore_\") then\n"\
-        "                    _ignore_lua_test()\n"\
-        "                else\n"\
-        "                    _G[key]()\n"\
-        "                end\n"\
-        "                    _count_lua_test()\n"\
-        "                _G[key] = nil\n"\
-        "            end\n"\
-        "        end\n"\
-        "    end\n"\
-        "end";
-        char cwd[1024] = {0};
-        int result;
-        DIR *dir = NULL;
-        struct dirent *ent = NULL;
-        char* error = NULL;
-        _L = luaL_newstate();
-        luaL_openlibs(_L);
-        for(ii=0; ii<(int)sizeof(_lua_test_methods)/(int)sizeof(_lua_test_methods[0])-1; ++ii) {
-            lua_pushcfunction(_L, _lua_test_methods[ii].func);
-            lua_setglobal(_L, _lua_test_methods[ii].name);
-        }
-        lua_pushcfunction(_L, _count_lua_test);
-        lua_setglobal(_L, "_count_lua_test");
-        lua_pushcfunction(_L, _ignore_lua_test);
-        lua_setglobal(_L, "_ignore_lua_test");
-        luaL_dostring(_L, script);
-    #endif /* LUA_TESTS */
+    _seed = (uint32_t)time(NULL);
+    for(ii=1;ii<argc && !usage_error;++ii) {
+        if(strcmp(argv[ii], "--update-snapshots") == 0)
+            _update_snapshots = 1;
+        else if(strcmp(argv[ii], "--journal") == 0 && ii+1 < argc)
+            _journal_open(argv[++ii]);
+        else if(strcmp(argv[ii], "--reporter") == 0 && ii+1 < argc) {
+            _reporter = _find_reporter(argv[++ii]);
+            if(_reporter == NULL) {
+                fprintf(stderr, "Unknown reporter %s (expected console, json or none)\n", argv[ii]);
+                usage_error = 1;
+            }
+        }
+        else if(strcmp(argv[ii], "--quiet") == 0)
+            _quiet = 1;
+        else if(strcmp(argv[ii], "--watch") == 0)
+            _watch = 1;
+        else if(strcmp(argv[ii], "--repeat") == 0 && ii+1 < argc)
+            _repeat_count = atoi(argv[++ii]);
+        else if(strcmp(argv[ii], "--until-fail") == 0)
+            _until_fail = 1;
+        else if(strcmp(argv[ii], "--jobs") == 0 && ii+1 < argc)
+            _num_jobs = atoi(argv[++ii]);
+        else if(strcmp(argv[ii], "--seed") == 0 && ii+1 < argc)
+            _seed = (uint32_t)strtoul(argv[++ii], NULL, 0);
+        else if(strcmp(argv[ii], "--timeout") == 0 && ii+1 < argc)
+            _test_timeout_ms = atoi(argv[++ii]);
+        else if(strcmp(argv[ii], "--poison-arena") == 0)
+            _poison_arena = 1;
+        else if(strcmp(argv[ii], "--no-usage") == 0)
+            _no_usage = 1;
+        else if(strcmp(argv[ii], "--usage") == 0)
+            _report_usage = 1;
+        else if(strcmp(argv[ii], "--driver") == 0)
+            _driver_mode = 1;
+        else if(strcmp(argv[ii], "--driver-socket") == 0 && ii+1 < argc) {
+            _driver_mode = 1;
+            _driver_socket = argv[++ii];
+        }
+        else if(strcmp(argv[ii], "--changed") == 0 && ii+1 < argc) {
+            _select_changed = 1;
+            _string_list_add(&_changed_files, argv[ii+1], strlen(argv[ii+1]));
+            ++ii;
+        }
+        else if(strcmp(argv[ii], "--changed-list") == 0 && ii+1 < argc)
+            _read_changed_list(argv[++ii]);
+        else if(strcmp(argv[ii], "--changed-since") == 0 && ii+1 < argc)
+            usage_error = _read_git_changes(argv[++ii]) != 0;
+        else if(strcmp(argv[ii], "--build-dir") == 0 && ii+1 < argc)
+            _build_dir = argv[++ii];
+    }
+    if(usage_error) {
+        _string_list_free(&_changed_files);
+        _journal_close();
+        return -1;
+    }
 
-    printf("------------------------------------------------------------");
+    if(_driver_mode)
+        _reporter = &_json_reporter;
+    else
+        _reporter->begin_run();
+    _measure_usage = !_no_usage && (_report_usage || _reporter == &_json_reporter);
+    if(_select_changed)
+        _select_tests();
 
     /* Seed a random number */
-    srand((uint32_t)time(NULL));
+    srand(_seed);
+    #if LUA_TESTS
+        _L = _create_lua_state();
+    #endif /* LUA_TESTS */
 
-    /* C++ tests */
-    for(ii=0;ii<_num_tests;++ii) {
-        if(ii % 60 == 0)
-            printf("\n");
-        _current_result = kResultPass;
-        _test_funcs[ii]();
-        switch(_current_result)
-        {
-        case kResultPass: _num_tests_passed++; printf("."); break;
-        case kResultFail: _num_tests_failed++; break;
-        case kResultIgnore: _num_tests_ignored++; printf("!"); break;
+    if(_driver_mode) {
+        _run_driver();
+    } else if(_repeat_count > 0 || _until_fail) {
+        _run_repeated();
+    } else {
+        /* C++ tests */
+        for(ii=0;ii<_num_tests;++ii) {
+            if(!_tests[ii].selected || _tests[ii].func == NULL)
+                continue;
+            _start_test(_tests[ii].name);
+            _tests[ii].func();
+            _finish_test();
         }
+        _run_async_tests(_tests, _num_tests, NULL);
+
+        /* Lua tests */
+        #if LUA_TESTS
+            _run_lua_tests(_L);
+        #endif /* LUA_TESTS */
     }
 
-    /* Lua tests */
+    if(!_driver_mode) {
+        if(_report_usage && !_quiet)
+            _report_usage_outliers();
+        _reporter->end_run(_num_tests_failed, _num_tests_passed, _num_tests_ignored,
+                           _num_tests_failed + _num_tests_passed + _num_tests_ignored);
+    }
+    _string_list_free(&_changed_files);
+    _output_flush();
+    if(_watch)
+        _watch_for_changes(argc, argv);
     #if LUA_TESTS
-        error = getcwd(cwd, sizeof(cwd));
-        if(error == NULL)
-            perror("Could not get current working directory");
-        if ((dir = opendir (".")) != NULL) {
-            /* print all the files and directories within directory */
-            while ((ent = readdir (dir)) != NULL) {
-                const char* str = ent->d_name;
-                const char* ext = _get_ext(ent->d_name);
-                if(ext == NULL)
-                    continue;
-                if(strlen(str) >= 2 && str[0] == '.' && str[1] == '_') /* Ignore OS X ._* files*/
-                    continue;
-                if(strcmp(ext, "lua") == 0) {
-                    snprintf(_current_lua_test_file,  sizeof(_current_lua_test_file), "%s/%s", cwd, str);
-                    _current_result = kResultPass;
-
-                    result = luaL_loadfile(_L, str);
-                    if(result) {
-                        printf("\n%s\n", lua_tostring(_L, -1));
-                    } else {
-                        luaL_dofile(_L, str);
-                        lua_getglobal(_L, "run_tests");
-                        lua_pcall(_L, 0, 0, 0);
-                    }
-                }
-            }
-            closedir (dir);
-        } else {
-            /* could not open directory */
-            perror ("");
-        }
         lua_close(_L);
     #endif /* LUA_TESTS */
+    _buffer_free(&_output);
+    _arena_free(&_arena);
+    _usage_free();
+    _journal_close();
 
 
-    printf("\n------------------------------------------------------------\n");
-    printf("%d failed, %d passed, %d ignored, %d total\n",
-            _num_tests_failed, _num_tests_passed, _num_tests_ignored, _num_tests);
-
-
-    return _num_tests_failed;
-    (void)sizeof(argc);
-    (void)sizeof(*argv);
+    /* Failures no test could own still fail the run */
+    return _num_tests_failed + (_stray_context.num_failures > 0);
 }
@@ -16,6 +16,8 @@
 #endif
 
 typedef void (test_func_t)(void);
+typedef struct ut_async_t ut_async_t;
+typedef void (async_test_func_t)(ut_async_t* test);
 
 /** @brief Test creation macros
  */
@@ -25,14 +27,19 @@ typedef void (test_func_t)(void);
 
     #define TEST(test_name) \
         static void TEST_##test_name(void); \
-        static int _##test_name##_register = _register_test(&TEST_##test_name); \
+        static int _##test_name##_register = _register_test(&TEST_##test_name, #test_name, __FILE__); \
         static void TEST_##test_name(void)
 
     #define IGNORE_TEST(test_name) \
         void TEST_##test_name(void);    \
-        static int _##test_name##_register = _register_test(&_ignore_test); \
+        static int _##test_name##_register = _register_test(&_ignore_test, #test_name, __FILE__); \
         void TEST_##test_name(void)
 
+    #define ASYNC_TEST(test_name) \
+        static void TEST_##test_name(ut_async_t* test); \
+        static int _##test_name##_register = _register_async_test(&TEST_##test_name, #test_name, __FILE__, __LINE__); \
+        static void TEST_##test_name(ut_async_t* test)
+
     #define TEST_FIXTURE(fixture, test_name)                                                           \
         struct TEST_##test_name : public fixture {                                                     \
             void test(void);                                                                           \
@@ -41,7 +48,8 @@ typedef void (test_func_t)(void);
             TEST_##test_name test;                                                                     \
             test.test();                                                                               \
         }                                                                                              \
-        static int _##fixture##_##test_name##_register = _register_test(&TEST_##fixture##_##test_name); \
+        static int _##fixture##_##test_name##_register =                                               \
+            _register_test(&TEST_##fixture##_##test_name, #fixture "." #test_name, __FILE__);          \
         void TEST_##test_name::test(void )
 
     #define IGNORE_TEST_FIXTURE(fixture, test_name)                                                    \
@@ -52,7 +60,8 @@ typedef void (test_func_t)(void);
             TEST_##test_name test;                                                                     \
             test.test();                                                                               \
         }                                                                                              \
-        static int _##fixture##_##test_name##_register = __ignore_test(&TEST_##fixture##_##test_name); \
+        static int _##fixture##_##test_name##_register =                                               \
+            __ignore_test(&TEST_##fixture##_##test_name, #fixture "." #test_name, __FILE__);           \
         void TEST_##test_name::test(void )
 
     extern "C" { // Use C linkage
@@ -70,8 +79,17 @@ typedef void (test_func_t)(void);
         static test_func_t* _##test_name##_register = &_ignore_test; \
         void TEST_##test_name(void)
 
+    #define ASYNC_TEST(test_name) \
+        static void TEST_##test_name(ut_async_t* test); \
+        static async_test_func_t* _##test_name##_register_async = &TEST_##test_name; \
+        enum { _##test_name##_async_line = __LINE__ }; \
+        static void TEST_##test_name(ut_async_t* test)
+
     #define REGISTER_TEST(test_name) \
-        _register_test(_##test_name##_register)
+        _register_test(_##test_name##_register, #test_name, __FILE__)
+
+    #define REGISTER_ASYNC_TEST(test_name) \
+        _register_async_test(_##test_name##_register_async, #test_name, __FILE__, _##test_name##_async_line)
 
     #define TEST_MODULE(module_name)    \
         void MODULE_##module_name(void);  \
@@ -84,9 +102,10 @@ typedef void (test_func_t)(void);
         MODULE_##module_name();
 #endif
 
-int _register_test(test_func_t* func);
+int _register_test(test_func_t* func, const char* name, const char* file);
 void _ignore_test(void);
-int __ignore_test(test_func_t* func);
+int __ignore_test(test_func_t* func, const char* name, const char* file);
+int _register_async_test(async_test_func_t* func, const char* name, const char* file, int line);
 
 /** Checking functions
  */
@@ -172,6 +191,160 @@ void _check_greater_than_equal_float(const char* file, int line, double left, do
 void _check_equal_string(const char* file, int line, const char* expected, const char* actual);
 void _check_not_equal_string(const char* file, int line, const char* expected, const char* actual);
 
+/* snapshot */
+#define CHECK_MATCHES_SNAPSHOT(path, buffer, size) \
+    _check_matches_snapshot(__FILE__, __LINE__, path, (const void*)(buffer), (size_t)(size))
+
+/** @brief Compares a buffer against a golden file on disk. Run with
+ *      --update-snapshots to (re)write the golden files instead.
+ */
+void _check_matches_snapshot(const char* file, int line, const char* path, const void* buffer, size_t size);
+
+/** @brief Seed for the running test. Each --repeat iteration gets its own,
+ *      reported with the first failure; pass it to --seed to reproduce.
+ */
+uint32_t ut_seed(void);
+
+/** @brief Hands the running test's failures to func instead of failing the
+ *      test, until called again with NULL or the test finishes. Lets tests
+ *      check what a failing check reports.
+ */
+typedef void (ut_failure_func_t)(const char* file, int line, const char* message, void* data);
+void ut_set_failure_hook(ut_failure_func_t* func, void* data);
+
+/** Scratch memory
+ *  Memory from ut_alloc lasts until the test finishes and is released all at
+ *  once; it is never freed individually. Each thread the framework runs tests
+ *  on has its own arena. Memory allocated on ut_stress threads is released
+ *  when ut_stress returns, and async tests share one arena until they have
+ *  all finished. Run with --poison-arena to fill released and fresh memory
+ *  with 0xdd bytes, so stale and uninitialized reads stand out.
+ */
+
+/** @brief Returns size bytes aligned for any basic type (16 bytes)
+ */
+void* ut_alloc(size_t size);
+
+/** @brief Returns size bytes aligned to alignment, a power of two
+ */
+void* ut_alloc_aligned(size_t size, size_t alignment);
+
+/** @brief Copies str into scratch memory
+ */
+char* ut_strdup(const char* str);
+
+/** Concurrency helpers
+ *  Checks may be called from any thread. Failures count against the test that
+ *  started the thread.
+ */
+typedef void (ut_stress_func_t)(void* data, int thread_index, int round);
+
+enum {
+    UT_STRESS_RANDOM_YIELD = 1 /**< ut_stress_yield randomly yields the thread */
+};
+
+/** @brief Runs func on num_threads threads released together from a barrier,
+ *      repeated for num_rounds rounds. Stops after the first failing round.
+ */
+void ut_stress(int num_threads, int num_rounds, ut_stress_func_t* func, void* data, int flags);
+
+/** @brief Call from a stress body to perturb thread interleavings. Does
+ *      nothing unless ut_stress was given UT_STRESS_RANDOM_YIELD.
+ */
+void ut_stress_yield(void);
+
+/** Latency histograms
+ *  HDR-style log-linear buckets give under 2% relative error over
+ *  the full 64-bit range with constant-time recording. A zero-initialized
+ *  histogram is empty. Record on one histogram per thread and merge them.
+ */
+enum {
+    UT_HIST_SUB_BUCKET_BITS = 7,
+    UT_HIST_SUB_BUCKETS = 1 << UT_HIST_SUB_BUCKET_BITS,
+    UT_HIST_BUCKETS = (64 - UT_HIST_SUB_BUCKET_BITS + 2) * (UT_HIST_SUB_BUCKETS / 2)
+};
+
+typedef struct ut_histogram_t {
+    uint64_t    count;
+    uint64_t    min;
+    uint64_t    max;
+    uint64_t    sum;
+    uint64_t    buckets[UT_HIST_BUCKETS];
+} ut_histogram_t;
+
+#define UT_HIST_RECORD(histogram, value) \
+    ut_hist_record(histogram, (uint64_t)(value))
+
+void ut_hist_reset(ut_histogram_t* histogram);
+void ut_hist_record(ut_histogram_t* histogram, uint64_t value);
+void ut_hist_merge(ut_histogram_t* dest, const ut_histogram_t* src);
+
+/** @brief Returns the value at or below which the given percentage (0-100)
+ *      of recorded values fall. Values are reported at bucket precision.
+ */
+uint64_t ut_hist_percentile(const ut_histogram_t* histogram, double percentile);
+
+/** Asynchronous tests
+ *  An ASYNC_TEST runs until it calls ut_done, usually from a callback. All
+ *  async tests in flight share one event loop that calls back on the thread
+ *  running the tests; call these functions from the test or its callbacks.
+ */
+enum {
+    UT_READABLE = 1,
+    UT_WRITABLE = 2
+};
+
+typedef void (ut_io_func_t)(ut_async_t* test, int fd, int events, void* data);
+typedef void (ut_timer_func_t)(ut_async_t* test, void* data);
+
+/** @brief Completes the test and cancels its fd watches and timers
+ */
+void ut_done(ut_async_t* test);
+
+/** @brief Calls func each time fd is ready for any of events (UT_READABLE,
+ *      UT_WRITABLE) until unwatched or the test completes. Watching a fd
+ *      again replaces its watch. Not supported on Windows.
+ *  @return 0 on success
+ */
+int ut_watch_fd(ut_async_t* test, int fd, int events, ut_io_func_t* func, void* data);
+void ut_unwatch_fd(ut_async_t* test, int fd);
+
+/** @brief Calls func once, ms milliseconds from now
+ */
+void ut_after(ut_async_t* test, int ms, ut_timer_func_t* func, void* data);
+
+/** @brief Fails the test unless it completes within ms of starting. The
+ *      default is 10 seconds, or --timeout.
+ */
+void ut_set_timeout(ut_async_t* test, int ms);
+
+/** @brief Monotonic clock in nanoseconds, for timing code under test
+ */
+uint64_t ut_now_ns(void);
+
+#define CHECK_PERCENTILE_BELOW(histogram, percentile, limit) \
+    _check_percentile_below(__FILE__, __LINE__, histogram, (double)(percentile), (uint64_t)(limit))
+
+void _check_percentile_below(const char* file, int line, const ut_histogram_t* histogram, double percentile, uint64_t limit);
+
+/** Resource budgets
+ *  Declared in the running test and checked as it finishes, against what it
+ *  used from its first declaration on, so declare them at the top of the
+ *  test: growth of the resident set in bytes, and CPU time in milliseconds.
+ *  Only tests that declare a budget are sampled. CPU time is the test
+ *  thread's own where the platform has a per-thread clock, so threads the
+ *  test starts, ut_stress workers included, are not counted; elsewhere it is
+ *  the whole process's user plus system time. Only C tests that run one at a time are
+ *  measured. Elsewhere, on Windows and with --no-usage, these checks pass.
+ */
+#define CHECK_MAX_RSS_GROWTH(bytes) \
+    _check_max_rss_growth(__FILE__, __LINE__, (int64_t)(bytes))
+#define CHECK_MAX_CPU_MS(ms) \
+    _check_max_cpu_ms(__FILE__, __LINE__, (int64_t)(ms))
+
+void _check_max_rss_growth(const char* file, int line, int64_t limit);
+void _check_max_cpu_ms(const char* file, int line, int64_t limit);
+
 
 #if defined(__OBJC__) && defined(__cplusplus)
     #import <XCTest/XCTest.h>
@@ -339,4 +512,309 @@ int run_all_tests(int argc, const char* argv[]);
     } // extern "C" {
 #endif
 
+#if defined(__cplusplus) && !defined(__OBJC__)
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <string>
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+    #define UT_CPP11 1
+    #include <type_traits>
+#endif
+
+/** C++ checks
+ *  In C++ the integer checks keep their argument types instead of casting to
+ *  int64_t. Integers compare exactly whatever their width and sign, so a
+ *  uint64_t above 2^63 compares correctly against any int64_t. Other types
+ *  use their own operator== and operator<. Values are only formatted once a
+ *  check fails, with operator<< where the type has one.
+ *
+ *  CHECK_EQUAL_RANGE compares two containers or arrays element by element in
+ *  one call, and CHECK_EQUAL_ARRAY two pointers to count elements. With
+ *  C++11 a range is anything std::begin accepts, and scoped enums and nullptr
+ *  print as values.
+ */
+namespace ut {
+namespace detail {
+
+enum { kOther, kInteger, kFloat };
+
+template<typename T> struct kind_of {
+    enum { value = !std::numeric_limits<T>::is_specialized ? kOther :
+                   std::numeric_limits<T>::is_integer ? kInteger : kFloat };
+};
+template<typename T, size_t N> struct kind_of<T[N]> {
+    enum { value = kOther };
+};
+
+template<bool is_signed> struct sign_of {
+    template<typename T> static bool negative(T) { return false; }
+};
+template<> struct sign_of<true> {
+    template<typename T> static bool negative(T number) { return number < 0; }
+};
+
+/* Compares sign first, then magnitude in the widest type of that sign */
+template<typename L, typename R> int compare_integers(L left, R right)
+{
+    const bool left_negative = sign_of<std::numeric_limits<L>::is_signed>::negative(left);
+    const bool right_negative = sign_of<std::numeric_limits<R>::is_signed>::negative(right);
+    if(left_negative != right_negative)
+        return left_negative ? -1 : 1;
+    if(left_negative) {
+        const int64_t l = static_cast<int64_t>(left);
+        const int64_t r = static_cast<int64_t>(right);
+        return (l > r) - (l < r);
+    } else {
+        const uint64_t l = static_cast<uint64_t>(left);
+        const uint64_t r = static_cast<uint64_t>(right);
+        return (l > r) - (l < r);
+    }
+}
+
+template<int left_kind, int right_kind> struct comparer {
+    template<typename L, typename R> static bool equal(const L& left, const R& right) { return left == right; }
+    template<typename L, typename R> static bool less(const L& left, const R& right) { return left < right; }
+};
+template<> struct comparer<kInteger, kInteger> {
+    template<typename L, typename R> static bool equal(L left, R right) { return compare_integers(left, right) == 0; }
+    template<typename L, typename R> static bool less(L left, R right) { return compare_integers(left, right) < 0; }
+};
+struct float_comparer {
+    template<typename L, typename R> static bool equal(L left, R right)
+    {
+        return static_cast<long double>(left) == static_cast<long double>(right);
+    }
+    template<typename L, typename R> static bool less(L left, R right)
+    {
+        return static_cast<long double>(left) < static_cast<long double>(right);
+    }
+};
+template<> struct comparer<kFloat, kFloat> : float_comparer {};
+template<> struct comparer<kFloat, kInteger> : float_comparer {};
+template<> struct comparer<kInteger, kFloat> : float_comparer {};
+
+template<typename L, typename R> bool equal(const L& left, const R& right)
+{
+    return comparer<kind_of<L>::value, kind_of<R>::value>::equal(left, right);
+}
+template<typename L, typename R> bool less(const L& left, const R& right)
+{
+    return comparer<kind_of<L>::value, kind_of<R>::value>::less(left, right);
+}
+
+/* Tells whether T has an operator<<. The fallback operator needs a
+ * conversion to any, so it is only picked when nothing better exists.
+ */
+namespace fallback {
+    struct no_insertion {};
+    struct any { template<typename T> any(const T&) {} };
+    no_insertion operator<<(std::ostream&, const any&);
+
+    template<typename T> struct has_insertion {
+        static std::ostream& stream();
+        static const T& object();
+        static char check(std::ostream&);
+        static char (&check(const no_insertion&))[2];
+        enum { value = sizeof(check(stream() << object())) == 1 };
+    };
+}
+
+#if UT_CPP11
+template<typename T> void print_unprintable(std::ostream& out, const T& object, std::true_type)
+{
+    out << +static_cast<typename std::underlying_type<T>::type>(object);
+}
+template<typename T> void print_unprintable(std::ostream& out, const T&, std::false_type)
+{
+    out << "<" << sizeof(T) << "-byte object>";
+}
+#endif
+
+template<bool printable> struct printer {
+    template<typename T> static void print(std::ostream& out, const T& object)
+    {
+    #if UT_CPP11
+        print_unprintable(out, object, std::is_enum<T>());
+    #else
+        out << "<" << sizeof(T) << "-byte object>";
+        (void)sizeof(object);
+    #endif
+    }
+};
+template<> struct printer<true> {
+    template<typename T> static void print(std::ostream& out, const T& object) { out << object; }
+};
+
+template<int kind> struct formatter {
+    template<typename T> static void format(std::ostream& out, const T& object)
+    {
+        printer<fallback::has_insertion<T>::value>::print(out, object);
+    }
+};
+template<> struct formatter<kInteger> {
+    template<typename T> static void format(std::ostream& out, T number)
+    {
+        if(sign_of<std::numeric_limits<T>::is_signed>::negative(number))
+            out << static_cast<int64_t>(number);
+        else
+            out << static_cast<uint64_t>(number);
+    }
+};
+template<> struct formatter<kFloat> {
+    template<typename T> static void format(std::ostream& out, T number)
+    {
+        /* max_digits10, which C++98 lacks, so values print distinctly */
+        out.precision(std::numeric_limits<T>::digits * 30103 / 100000 + 2);
+        out << number;
+    }
+};
+
+template<typename T> void format(std::ostream& out, const T& object)
+{
+    formatter<kind_of<T>::value>::format(out, object);
+}
+inline void format(std::ostream& out, bool flag) { out << (flag ? "true" : "false"); }
+inline void format(std::ostream& out, const std::string& text) { out << '"' << text << '"'; }
+/* CHECK_EQUAL compares char pointers, not strings, so print the pointer */
+inline void format(std::ostream& out, const char* pointer) { out << static_cast<const void*>(pointer); }
+inline void format(std::ostream& out, char* pointer) { out << static_cast<const void*>(pointer); }
+#if UT_CPP11
+inline void format(std::ostream& out, std::nullptr_t) { out << "nullptr"; }
+#endif
+
+inline void report_failure(const char* file, int line, const std::ostringstream& message)
+{
+    _fail(file, line, "%s", message.str().c_str());
+}
+template<typename L, typename R>
+void report_comparison(const char* file, int line, const L& left, const char* relation, const R& right)
+{
+    std::ostringstream message;
+    format(message, left);
+    message << relation;
+    format(message, right);
+    report_failure(file, line, message);
+}
+
+template<typename E, typename A> void check_equal(const char* file, int line, const E& expected, const A& actual)
+{
+    if(!equal(expected, actual)) {
+        std::ostringstream message;
+        message << "Expected: ";
+        format(message, expected);
+        message << "  Actual: ";
+        format(message, actual);
+        report_failure(file, line, message);
+    }
+}
+template<typename E, typename A> void check_not_equal(const char* file, int line, const E& expected, const A& actual)
+{
+    if(equal(expected, actual)) {
+        std::ostringstream message;
+        message << "Actual value equals expected: ";
+        format(message, actual);
+        report_failure(file, line, message);
+    }
+}
+template<typename L, typename R> void check_less_than(const char* file, int line, const L& left, const R& right)
+{
+    if(!less(left, right))
+        report_comparison(file, line, left, " is not less than ", right);
+}
+template<typename L, typename R> void check_greater_than(const char* file, int line, const L& left, const R& right)
+{
+    if(!less(right, left))
+        report_comparison(file, line, left, " is not greater than ", right);
+}
+template<typename L, typename R> void check_less_than_equal(const char* file, int line, const L& left, const R& right)
+{
+    if(less(right, left))
+        report_comparison(file, line, left, " is not less than or equal to ", right);
+}
+template<typename L, typename R> void check_greater_than_equal(const char* file, int line, const L& left, const R& right)
+{
+    if(less(left, right))
+        report_comparison(file, line, left, " is not greater than or equal to ", right);
+}
+
+template<typename EI, typename AI>
+void check_equal_range(const char* file, int line, EI expected, EI expected_end, AI actual, AI actual_end)
+{
+    typedef typename std::iterator_traits<EI>::value_type expected_t;
+    typedef typename std::iterator_traits<AI>::value_type actual_t;
+    size_t index = 0;
+    for(; expected != expected_end && actual != actual_end; ++expected, ++actual, ++index) {
+        /* Copies see through proxies such as std::vector<bool>'s */
+        const expected_t& expected_value = *expected;
+        const actual_t& actual_value = *actual;
+        if(!equal(expected_value, actual_value)) {
+            std::ostringstream message;
+            message << "Ranges differ at index " << index << "  Expected: ";
+            format(message, expected_value);
+            message << "  Actual: ";
+            format(message, actual_value);
+            report_failure(file, line, message);
+            return;
+        }
+    }
+    if(expected != expected_end || actual != actual_end) {
+        std::ostringstream message;
+        message << "Expected " << index + static_cast<size_t>(std::distance(expected, expected_end))
+                << " elements  Actual: " << index + static_cast<size_t>(std::distance(actual, actual_end));
+        report_failure(file, line, message);
+    }
+}
+
+#if UT_CPP11
+template<typename R> auto range_begin(const R& range) -> decltype(std::begin(range)) { return std::begin(range); }
+template<typename R> auto range_end(const R& range) -> decltype(std::end(range)) { return std::end(range); }
+#else
+template<typename C> typename C::const_iterator range_begin(const C& container) { return container.begin(); }
+template<typename C> typename C::const_iterator range_end(const C& container) { return container.end(); }
+template<typename T, size_t N> const T* range_begin(const T (&array)[N]) { return array; }
+template<typename T, size_t N> const T* range_end(const T (&array)[N]) { return array + N; }
+#endif
+
+template<typename E, typename A> void check_equal_range(const char* file, int line, const E& expected, const A& actual)
+{
+    check_equal_range(file, line, range_begin(expected), range_end(expected), range_begin(actual), range_end(actual));
+}
+template<typename E, typename A> void check_equal_array(const char* file, int line, E expected, A actual, size_t count)
+{
+    check_equal_range(file, line, expected, expected + count, actual, actual + count);
+}
+
+} // namespace detail
+} // namespace ut
+
+    /* integer */
+    #undef CHECK_EQUAL
+    #undef CHECK_NOT_EQUAL
+    #undef CHECK_LESS_THAN
+    #undef CHECK_GREATER_THAN
+    #undef CHECK_LESS_THAN_EQUAL
+    #undef CHECK_GREATER_THAN_EQUAL
+
+    #define CHECK_EQUAL(expected, actual) \
+        ut::detail::check_equal(__FILE__, __LINE__, expected, actual)
+    #define CHECK_NOT_EQUAL(expected, actual) \
+        ut::detail::check_not_equal(__FILE__, __LINE__, expected, actual)
+    #define CHECK_LESS_THAN(left, right) \
+        ut::detail::check_less_than(__FILE__, __LINE__, left, right)
+    #define CHECK_GREATER_THAN(left, right) \
+        ut::detail::check_greater_than(__FILE__, __LINE__, left, right)
+    #define CHECK_LESS_THAN_EQUAL(left, right) \
+        ut::detail::check_less_than_equal(__FILE__, __LINE__, left, right)
+    #define CHECK_GREATER_THAN_EQUAL(left, right) \
+        ut::detail::check_greater_than_equal(__FILE__, __LINE__, left, right)
+
+    /* range */
+    #define CHECK_EQUAL_RANGE(expected, actual) \
+        ut::detail::check_equal_range(__FILE__, __LINE__, expected, actual)
+    #define CHECK_EQUAL_ARRAY(expected, actual, count) \
+        ut::detail::check_equal_array(__FILE__, __LINE__, expected, actual, static_cast<size_t>(count))
+#endif /* __cplusplus */
+
 #endif /* include guard */
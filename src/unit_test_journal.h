@@ -0,0 +1,56 @@
+/** @file unit_test_journal.h
+ *  @brief On-disk layout of the results journal written by --journal
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ *
+ *  The journal is a header followed by fixed-size records, one per test, in
+ *  the order the tests started. A record is published (count is bumped) as
+ *  its test starts, with kJournalRunning status, and completed when the test
+ *  finishes, so a record left running after the process died marks the test
+ *  that crashed. Readers may open the file while the run is in progress.
+ */
+#ifndef __unit_test_journal_h__
+#define __unit_test_journal_h__
+
+#include <stdint.h>
+
+enum {
+    UT_JOURNAL_MAGIC = 0x4c4e4a55, /* "UJNL" */
+    UT_JOURNAL_VERSION = 1,
+    UT_JOURNAL_NAME_SIZE = 96,
+    UT_JOURNAL_FILE_SIZE = 136
+};
+
+typedef enum {
+    kJournalRunning,
+    kJournalPass,
+    kJournalFail,
+    kJournalIgnore
+} journal_status_t;
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    header_size;
+    uint32_t    record_size;
+    uint32_t    capacity;
+    uint32_t    count;      /**< Number of published records */
+    uint32_t    finished;   /**< Non-zero once the run completed */
+    uint32_t    pid;
+    uint64_t    start_time; /**< Seconds since the epoch */
+    uint32_t    num_failed;
+    uint32_t    num_passed;
+    uint32_t    num_ignored;
+    uint32_t    reserved[3];
+} ut_journal_header_t;
+
+typedef struct {
+    uint32_t    id;
+    uint32_t    status;     /**< journal_status_t */
+    uint64_t    duration_ns;
+    int32_t     line;       /**< Line of the first failure */
+    uint32_t    reserved;
+    char        name[UT_JOURNAL_NAME_SIZE];
+    char        file[UT_JOURNAL_FILE_SIZE]; /**< File of the first failure */
+} ut_journal_record_t;
+
+#endif /* include guard */
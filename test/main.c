@@ -7,15 +7,24 @@
 /* Internal functions
  */
 DECLARE_MODULE(unit_test);
+DECLARE_MODULE(unit_test_runner);
+DECLARE_MODULE(unit_test_fixtures);
 static void register_tests(void)
 {
     REGISTER_MODULE(unit_test);
+    REGISTER_MODULE(unit_test_runner);
+}
+/* Tests that fail on purpose, run by unit_test_runner in child processes */
+static void register_fixtures(void)
+{
+    REGISTER_MODULE(unit_test_fixtures);
 }
 
 /* External functions
  */
 int main(int argc, const char* argv[])
 {
+    RUN_ALL_TESTS(argc, argv, "--fixtures", register_fixtures);
     RUN_ALL_TESTS(argc, argv, "-t", register_tests);
 
     return 0;
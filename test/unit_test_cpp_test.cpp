@@ -2,6 +2,9 @@
  *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
  */
 #include "unit_test.h"
+#include <list>
+#include <string>
+#include <vector>
 
 BEGIN_TESTS(UnitTest)
 
@@ -32,6 +35,18 @@ TEST(CheckIntLTGT)
     CHECK_GREATER_THAN_EQUAL(-564, -564);
     CHECK_GREATER_THAN_EQUAL(-564, -664);
 }
+TEST(CheckIntTypes)
+{
+    const uint64_t big = ~static_cast<uint64_t>(0);
+    const int64_t negative = -1;
+    CHECK_EQUAL(big, big);
+    CHECK_NOT_EQUAL(negative, big);
+    CHECK_LESS_THAN(negative, big);
+    CHECK_GREATER_THAN(big, static_cast<uint64_t>(1) << 63);
+    CHECK_EQUAL(42u, 42);
+    CHECK_LESS_THAN_EQUAL(-3, 2u);
+    CHECK_GREATER_THAN_EQUAL(static_cast<unsigned char>(200), static_cast<signed char>(-100));
+}
 TEST(CheckPointerEqual)
 {
     int* a = (int*)0xDEADBEEF;
@@ -66,6 +81,81 @@ TEST(CheckString)
     CHECK_NOT_EQUAL_STRING(a, c);
 }
 
+struct Point
+{
+    int x;
+    int y;
+    bool operator==(const Point& other) const { return x == other.x && y == other.y; }
+};
+
+TEST(CheckUserTypes)
+{
+    const Point a = {1, 2};
+    const Point b = {1, 2};
+    const std::string text("unit_test");
+    CHECK_EQUAL(a, b);
+    CHECK_EQUAL(std::string("unit_test"), text);
+    CHECK_LESS_THAN(std::string("a"), text);
+}
+static const long* _next_array(int* calls, const long* array)
+{
+    ++*calls;
+    return array;
+}
+TEST(CheckRanges)
+{
+    const long expected[] = {1, 2, 3};
+    std::vector<int> vector(expected, expected + 3);
+    std::list<unsigned int> list(expected, expected + 3);
+    std::vector<bool> flags(3, true);
+    int calls = 0;
+    CHECK_EQUAL_RANGE(expected, vector);
+    CHECK_EQUAL_RANGE(vector, list);
+    CHECK_EQUAL_RANGE(std::vector<bool>(3, true), flags);
+    CHECK_EQUAL_ARRAY(expected, &vector[0], 3);
+    /* Each argument is evaluated once */
+    CHECK_EQUAL_ARRAY(_next_array(&calls, expected), _next_array(&calls, expected), 3);
+    CHECK_EQUAL(2, calls);
+}
+
+static void _capture_failure(const char* file, int line, const char* message, void* data)
+{
+    static_cast<std::vector<std::string>*>(data)->push_back(message);
+    (void)sizeof(file);
+    (void)sizeof(line);
+}
+TEST(CheckFailureMessages)
+{
+    const int expected[] = {1, 2, 3};
+    const std::vector<int> changed(expected, expected + 3);
+    const std::vector<int> shorter(expected, expected + 2);
+    const uint64_t big = ~static_cast<uint64_t>(0);
+    const Point a = {1, 2};
+    const Point b = {3, 4};
+    std::vector<std::string> messages;
+    std::vector<int> different(changed);
+    different[1] = 5;
+
+    ut_set_failure_hook(&_capture_failure, &messages);
+    CHECK_EQUAL_RANGE(expected, different);
+    CHECK_EQUAL_RANGE(expected, shorter);
+    CHECK_EQUAL(a, b);
+    CHECK_EQUAL(0.1, 0.1f);
+    CHECK_EQUAL(big, big - 1);
+    CHECK_LESS_THAN(big, -1);
+    ut_set_failure_hook(NULL, NULL);
+
+    CHECK_EQUAL(6u, messages.size());
+    if(messages.size() != 6)
+        return;
+    CHECK_EQUAL(std::string("Ranges differ at index 1  Expected: 2  Actual: 5"), messages[0]);
+    CHECK_EQUAL(std::string("Expected 3 elements  Actual: 2"), messages[1]);
+    CHECK_EQUAL(std::string("Expected: <8-byte object>  Actual: <8-byte object>"), messages[2]);
+    CHECK_EQUAL(std::string("Expected: 0.10000000000000001  Actual: 0.100000001"), messages[3]);
+    CHECK_EQUAL(std::string("Expected: 18446744073709551615  Actual: 18446744073709551614"), messages[4]);
+    CHECK_EQUAL(std::string("18446744073709551615 is not less than -1"), messages[5]);
+}
+
 struct TestFixture
 {
     TestFixture()
@@ -0,0 +1,1011 @@
+/** @file unit_test_runner_test.c
+ *  @brief Tests of the runner as a whole: its options and what it prints.
+ *      Each test runs this binary again in a child process inside a scratch
+ *      directory, with some of the fixtures below registered, and checks
+ *      what the child printed, wrote and returned.
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+    #define _XOPEN_SOURCE 700 /* fork, mkdtemp and setenv under -std=c89 */
+#endif
+#include "unit_test.h"
+#include "unit_test_journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <pthread.h>
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/types.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+#ifdef __linux__
+
+/* Fixtures
+ *  These tests fail on purpose. They are only registered when the binary
+ *  runs with --fixtures, and then only the ones UT_FIXTURES names.
+ */
+TEST(Snapshots)
+{
+    const char binary[] = {'\0', 1, 9, 3};
+    CHECK_MATCHES_SNAPSHOT("text.golden", "one\n2\nthree\n", 12);
+    CHECK_MATCHES_SNAPSHOT("binary.golden", binary, sizeof(binary));
+    CHECK_MATCHES_SNAPSHOT("missing.golden", "new\n", 4);
+}
+TEST(Passing)
+{
+}
+/* Failing reports its failure on this line */
+enum { kFailingLine = __LINE__ + 3 };
+TEST(Failing)
+{
+    FAIL("Failing on purpose");
+}
+/* Flaky fails for one seed in kFlakyPeriod, on this line */
+enum { kFlakyPeriod = 7, kFlakyLine = __LINE__ + 3 };
+TEST(Flaky)
+{
+    CHECK_NOT_EQUAL(0, (int)(ut_seed() % kFlakyPeriod));
+}
+/* ArenaFill leaves a block behind that ArenaReuse gets back once the arena
+ * rewinds, filled with 0xdd under --poison-arena
+ */
+static unsigned char* _arena_block = NULL;
+TEST(ArenaFill)
+{
+    _arena_block = (unsigned char*)ut_alloc(64);
+    memset(_arena_block, 0x5a, 64);
+}
+TEST(ArenaReuse)
+{
+    unsigned char* block = (unsigned char*)ut_alloc(64);
+    int poisoned = 0;
+    int ii;
+    CHECK_EQUAL_POINTER(_arena_block, block);
+    for(ii=0; ii<64; ++ii)
+        poisoned += block[ii] == 0xdd;
+    CHECK_EQUAL(64, poisoned);
+}
+/* OverBudget uses more CPU time and memory than it allows itself */
+TEST(OverBudget)
+{
+    uint64_t start;
+    char* memory;
+    CHECK_MAX_CPU_MS(1);
+    CHECK_MAX_RSS_GROWTH(1024*1024);
+    start = ut_now_ns();
+    memory = (char*)ut_alloc(8*1024*1024);
+    while(ut_now_ns() - start < 30000000u) {
+    }
+    memset(memory, 1, 8*1024*1024);
+}
+TEST(Chatty)
+{
+    printf("Chatty output\n");
+}
+/* ThreadFailure and AsyncThreadFailure fail a check on a thread they start
+ * themselves, not through ut_stress
+ */
+static void* _failing_thread(void* arg)
+{
+    CHECK_EQUAL(1, 2);
+    return arg;
+}
+static void _run_failing_thread(void)
+{
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, &_failing_thread, NULL) != 0) {
+        FAIL("Could not start a thread");
+        return;
+    }
+    pthread_join(thread, NULL);
+}
+TEST(ThreadFailure)
+{
+    _run_failing_thread();
+}
+static void _async_failing_thread(ut_async_t* test, void* data)
+{
+    _run_failing_thread();
+    ut_done(test);
+    (void)sizeof(data);
+}
+ASYNC_TEST(AsyncThreadFailure)
+{
+    ut_after(test, 1, &_async_failing_thread, NULL);
+}
+/* Stalled never calls ut_done and reports its timeout on this line */
+enum { kStalledLine = __LINE__ + 1 };
+ASYNC_TEST(Stalled)
+{
+    ut_set_timeout(test, 10);
+}
+
+/* Child processes
+ */
+enum {
+    CHILD_OUTPUT_SIZE = 256*1024,
+    CHILD_TIMEOUT_MS = 20000
+};
+
+typedef struct {
+    char    dir[32];    /**< Scratch directory */
+    const char* cwd;    /**< Where in it the child runs, or NULL for the top */
+    pid_t   pid;
+    int     input;      /**< Write end of the child's stdin */
+    int     output;     /**< Read end of the child's stdout */
+    char*   text;       /**< Everything read from stdout so far */
+    size_t  size;
+    size_t  mark;       /**< Where _read_child starts looking */
+} child_t;
+
+#define CHECK_PRINTED(child, text) \
+    _check_printed(__FILE__, __LINE__, child, text, 1)
+#define CHECK_NOT_PRINTED(child, text) \
+    _check_printed(__FILE__, __LINE__, child, text, 0)
+
+static void _check_printed(const char* file, int line, const child_t* child, const char* text, int expected)
+{
+    if((strstr(child->text, text) != NULL) != expected)
+        _fail(file, line, "Child %s \"%s\" in:\n%.4000s", expected ? "did not print" : "printed",
+              text, child->text);
+}
+static int _make_scratch(child_t* child)
+{
+    memset(child, 0, sizeof(*child));
+    strcpy(child->dir, "/tmp/ut_runner_XXXXXX");
+    child->pid = -1;
+    child->input = child->output = -1;
+    child->text = (char*)ut_alloc(CHILD_OUTPUT_SIZE);
+    child->text[0] = '\0';
+    if(mkdtemp(child->dir) == NULL) {
+        FAIL("Could not create a scratch directory");
+        return 0;
+    }
+    return 1;
+}
+static void _remove_scratch(const child_t* child)
+{
+    char command[64];
+    sprintf(command, "rm -rf %s", child->dir);
+    CHECK_EQUAL(0, system(command));
+}
+static const char* _scratch_path(const child_t* child, const char* name)
+{
+    char* path = (char*)ut_alloc(strlen(child->dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", child->dir, name);
+    return path;
+}
+static void _write_scratch(const child_t* child, const char* name, const void* data, size_t size)
+{
+    FILE* file = fopen(_scratch_path(child, name), "wb");
+    CHECK_NOT_NULL(file);
+    if(file == NULL)
+        return;
+    CHECK_EQUAL(size, fwrite(data, 1, size, file));
+    fclose(file);
+}
+/* Returns the file's contents, NUL-terminated, or NULL if it does not exist */
+static char* _read_scratch(const child_t* child, const char* name)
+{
+    FILE* file = fopen(_scratch_path(child, name), "rb");
+    char* data = NULL;
+    long size = 0;
+    if(file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = (char*)ut_alloc((size_t)size + 1);
+    data[fread(data, 1, (size_t)size, file)] = '\0';
+    fclose(file);
+    return data;
+}
+static void _make_scratch_dir(const child_t* child, const char* name)
+{
+    CHECK_EQUAL(0, mkdir(_scratch_path(child, name), 0755));
+}
+static int _pipe_cloexec(int fds[2])
+{
+    if(pipe(fds) != 0)
+        return -1;
+    /* Keep other children, say from --jobs workers, from holding our ends */
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+/* Starts program with argv, a NULL-terminated list, in the scratch
+ * directory. Its stderr goes to the file "stderr" where it runs.
+ */
+static int _spawn(child_t* child, const char* program, const char* const* argv, const char* fixtures)
+{
+    int input[2];
+    int output[2];
+    if(_pipe_cloexec(input) != 0 || _pipe_cloexec(output) != 0) {
+        FAIL("Could not start a child process");
+        return 0;
+    }
+    child->pid = fork();
+    if(child->pid == 0) {
+        int error = -1;
+        if(dup2(input[0], STDIN_FILENO) < 0 || dup2(output[1], STDOUT_FILENO) < 0 || chdir(child->dir) != 0)
+            _exit(127);
+        if(child->cwd && chdir(child->cwd) != 0)
+            _exit(127);
+        error = open("stderr", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(error < 0 || dup2(error, STDERR_FILENO) < 0)
+            _exit(127);
+        setenv("UT_FIXTURES", fixtures, 1);
+        execv(program, (char* const*)argv);
+        _exit(127);
+    }
+    close(input[0]);
+    close(output[1]);
+    child->input = input[1];
+    child->output = output[0];
+    if(child->pid < 0) {
+        FAIL("Could not fork");
+        return 0;
+    }
+    return 1;
+}
+/* Finds a program built next to this binary, or this binary when name is NULL */
+static const char* _program_path(const char* name)
+{
+    char exe[1024];
+    ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe)-1);
+    size_t dir_length = 0;
+    char* path = NULL;
+    if(length <= 0)
+        return NULL;
+    exe[length] = '\0';
+    if(name == NULL)
+        return ut_strdup(exe);
+    dir_length = (size_t)(strrchr(exe, '/') + 1 - exe);
+    path = (char*)ut_alloc(dir_length + strlen(name) + 1);
+    sprintf(path, "%.*s%s", (int)dir_length, exe, name);
+    return path;
+}
+/* Starts program with args, a NULL-terminated list. Unless fixtures is
+ * NULL, the program is a test binary run with --fixtures and those fixtures
+ * (comma separated) registered.
+ */
+static int _start_program(child_t* child, const char* program, const char* fixtures, const char* const* args)
+{
+    const char* argv[16];
+    int argc = 0;
+    if(program == NULL) {
+        FAIL("Could not find the program to run");
+        return 0;
+    }
+    argv[argc++] = program;
+    if(fixtures)
+        argv[argc++] = "--fixtures";
+    while(args && *args && argc < 15)
+        argv[argc++] = *args++;
+    argv[argc] = NULL;
+    return _spawn(child, program, argv, fixtures ? fixtures : "");
+}
+static int _start_child(child_t* child, const char* fixtures, const char* const* args)
+{
+    return _start_program(child, _program_path(NULL), fixtures, args);
+}
+/* Reads the child's stdout until it has printed text past its mark, it
+ * closed stdout or timeout_ms passed. Returns non-zero once text was
+ * printed. Pass NULL to read until the child closes stdout.
+ */
+static int _read_child(child_t* child, const char* text, int timeout_ms)
+{
+    uint64_t deadline = ut_now_ns() + (uint64_t)timeout_ms * 1000000;
+    struct pollfd ready;
+    ssize_t length = 0;
+    ready.fd = child->output;
+    ready.events = POLLIN;
+    while(text == NULL || strstr(child->text + child->mark, text) == NULL) {
+        uint64_t now = ut_now_ns();
+        if(now >= deadline || child->size + 1 >= CHILD_OUTPUT_SIZE)
+            return 0;
+        if(poll(&ready, 1, (int)((deadline - now) / 1000000) + 1) <= 0)
+            continue;
+        length = read(child->output, child->text + child->size, CHILD_OUTPUT_SIZE - 1 - child->size);
+        if(length <= 0)
+            return text == NULL;
+        child->size += (size_t)length;
+        child->text[child->size] = '\0';
+    }
+    return 1;
+}
+/* Closes the child's stdin, reads the rest of its output and returns its
+ * exit status, or -1 if it had to be killed or did not exit normally
+ */
+static int _finish_child(child_t* child)
+{
+    int status = 0;
+    close(child->input);
+    if(!_read_child(child, NULL, CHILD_TIMEOUT_MS)) {
+        FAIL("Child did not finish in time");
+        kill(child->pid, SIGKILL);
+    }
+    close(child->output);
+    if(waitpid(child->pid, &status, 0) != child->pid || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+static void _reset_output(child_t* child)
+{
+    child->size = child->mark = 0;
+    child->text[0] = '\0';
+}
+/* Runs a child to completion, feeding it input if given */
+static int _run_child(child_t* child, const char* fixtures, const char* const* args, const char* input)
+{
+    if(!_start_child(child, fixtures, args))
+        return -1;
+    if(input)
+        CHECK_EQUAL((ssize_t)strlen(input), write(child->input, input, strlen(input)));
+    return _finish_child(child);
+}
+
+/* Tests
+ */
+TEST(SnapshotFailures)
+{
+    const char binary[] = {'\0', 1, 2, 3};
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    _write_scratch(&child, "text.golden", "one\ntwo\nthree\n", 14);
+    _write_scratch(&child, "binary.golden", binary, sizeof(binary));
+    CHECK_EQUAL(1, _run_child(&child, "Snapshots", NULL, NULL));
+    CHECK_PRINTED(&child, "Snapshot mismatch: text.golden (expected 14 bytes, actual 12 bytes, "
+                          "first difference at byte 4)");
+    CHECK_PRINTED(&child, "        1 | one\n  -     2 | two\n  +     2 | 2\n        3 | three\n");
+    CHECK_PRINTED(&child, "Snapshot mismatch: binary.golden (expected 4 bytes, actual 4 bytes, "
+                          "first difference at byte 2)");
+    CHECK_PRINTED(&child, "  -00000000 | 00 01 02 03\n  +00000000 | 00 01 09 03\n");
+    CHECK_PRINTED(&child, "Snapshot not found: missing.golden (run with --update-snapshots to create it)");
+    CHECK_NULL(_read_scratch(&child, "missing.golden"));
+    CHECK_EQUAL_STRING("one\ntwo\nthree\n", _read_scratch(&child, "text.golden"));
+    _remove_scratch(&child);
+}
+TEST(SnapshotUpdate)
+{
+    const char* update[] = {"--update-snapshots", NULL};
+    const char binary[] = {'\0', 1, 2, 3};
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    _write_scratch(&child, "text.golden", "one\ntwo\nthree\n", 14);
+    _write_scratch(&child, "binary.golden", binary, sizeof(binary));
+    CHECK_EQUAL(0, _run_child(&child, "Snapshots", update, NULL));
+    CHECK_PRINTED(&child, "Updated snapshot: text.golden");
+    CHECK_PRINTED(&child, "Updated snapshot: binary.golden");
+    CHECK_EQUAL_STRING("one\n2\nthree\n", _read_scratch(&child, "text.golden"));
+    CHECK_EQUAL_STRING("new\n", _read_scratch(&child, "missing.golden"));
+    CHECK_NULL(_read_scratch(&child, "text.golden.tmp"));
+
+    /* The rewritten files now match */
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Snapshots", NULL, NULL));
+    CHECK_NOT_PRINTED(&child, "Snapshot");
+    _remove_scratch(&child);
+}
+static const ut_journal_record_t* _find_record(const char* journal, const char* name)
+{
+    const ut_journal_header_t* header = (const ut_journal_header_t*)journal;
+    const ut_journal_record_t* records = (const ut_journal_record_t*)(journal + header->header_size);
+    uint32_t ii;
+    for(ii=0; ii<header->count; ++ii) {
+        if(strcmp(records[ii].name, name) == 0)
+            return records + ii;
+    }
+    _fail(__FILE__, __LINE__, "No journal record for %s", name);
+    return NULL;
+}
+TEST(JournalRoundTrip)
+{
+    const char* args[] = {"--journal", "journal.bin", NULL};
+    const char* json[] = {"--json", "journal.bin", NULL};
+    const char* tap[] = {"--tap", "journal.bin", NULL};
+    const char* junit[] = {"--junit", "journal.bin", NULL};
+    const ut_journal_header_t* header = NULL;
+    const ut_journal_record_t* record = NULL;
+    const char* journal = NULL;
+    char expected[256];
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    CHECK_EQUAL(1, _run_child(&child, "Passing,Failing", args, NULL));
+    journal = _read_scratch(&child, "journal.bin");
+    CHECK_NOT_NULL(journal);
+    if(journal == NULL)
+        return;
+    header = (const ut_journal_header_t*)journal;
+    CHECK_EQUAL(UT_JOURNAL_MAGIC, header->magic);
+    CHECK_EQUAL(UT_JOURNAL_VERSION, header->version);
+    CHECK_EQUAL(sizeof(ut_journal_header_t), header->header_size);
+    CHECK_EQUAL(sizeof(ut_journal_record_t), header->record_size);
+    CHECK_EQUAL(1, header->finished);
+    CHECK_EQUAL(1, header->num_failed);
+    CHECK_EQUAL(header->count, header->num_failed + header->num_passed + header->num_ignored);
+    record = _find_record(journal, "Passing");
+    if(record)
+        CHECK_EQUAL(kJournalPass, record->status);
+    record = _find_record(journal, "Failing");
+    if(record) {
+        CHECK_EQUAL(kJournalFail, record->status);
+        CHECK_EQUAL(kFailingLine, record->line);
+        CHECK_NOT_NULL(strstr(record->file, "unit_test_runner_test.c"));
+    }
+
+    /* The reader tool turns the same journal into each of its formats */
+    _reset_output(&child);
+    CHECK_TRUE(_start_program(&child, _program_path("ut_journal"), NULL, json));
+    CHECK_EQUAL(0, _finish_child(&child));
+    CHECK_PRINTED(&child, "\"finished\":true,\"failed\":1,");
+    sprintf(expected, "\"name\":\"Failing\",\"status\":\"fail\"");
+    CHECK_PRINTED(&child, expected);
+    sprintf(expected, "unit_test_runner_test.c\",\"line\":%d}", kFailingLine);
+    CHECK_PRINTED(&child, expected);
+    CHECK_PRINTED(&child, "\"name\":\"Passing\",\"status\":\"pass\"");
+
+    _reset_output(&child);
+    CHECK_TRUE(_start_program(&child, _program_path("ut_journal"), NULL, tap));
+    CHECK_EQUAL(0, _finish_child(&child));
+    sprintf(expected, "1..%u\n", (unsigned int)header->count);
+    CHECK_PRINTED(&child, expected);
+    CHECK_PRINTED(&child, " - Failing\n");
+    sprintf(expected, "unit_test_runner_test.c:%d\n", kFailingLine);
+    CHECK_PRINTED(&child, expected);
+
+    _reset_output(&child);
+    CHECK_TRUE(_start_program(&child, _program_path("ut_journal"), NULL, junit));
+    CHECK_EQUAL(0, _finish_child(&child));
+    sprintf(expected, "<testsuite name=\"unit_test\" tests=\"%u\" failures=\"1\" errors=\"0\"",
+            (unsigned int)header->count);
+    CHECK_PRINTED(&child, expected);
+    CHECK_PRINTED(&child, "<testcase name=\"Failing\"");
+    _remove_scratch(&child);
+}
+TEST(Reporters)
+{
+    const char* console[] = {"--reporter", "console", NULL};
+    const char* json[] = {"--reporter", "json", NULL};
+    const char* none[] = {"--reporter", "none", NULL};
+    const char* quiet[] = {"--quiet", NULL};
+    const char* unknown[] = {"--reporter", "xml", NULL};
+    char expected[256];
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    CHECK_EQUAL(1, _run_child(&child, "Passing,Failing", console, NULL));
+    CHECK_EQUAL(0, strncmp(child.text, "------------", 12));
+    sprintf(expected, "unit_test_runner_test.c(%d): error: Failing on purpose\n", kFailingLine);
+    CHECK_PRINTED(&child, expected);
+    CHECK_PRINTED(&child, "..");
+    CHECK_PRINTED(&child, "\n------------------------------------------------------------\n1 failed, ");
+
+    _reset_output(&child);
+    CHECK_EQUAL(1, _run_child(&child, "Passing,Failing", json, NULL));
+    CHECK_EQUAL(0, strncmp(child.text, "{\"event\":\"begin\"}\n", 18));
+    sprintf(expected, "{\"event\":\"failure\",\"name\":\"Failing\",\"file\":\"%s\",\"line\":%d,"
+            "\"message\":\"Failing on purpose\"}\n", __FILE__, kFailingLine);
+    CHECK_PRINTED(&child, expected);
+    CHECK_PRINTED(&child, "{\"event\":\"test\",\"name\":\"Failing\",\"status\":\"fail\",");
+    CHECK_PRINTED(&child, "{\"event\":\"test\",\"name\":\"Passing\",\"status\":\"pass\",");
+    CHECK_PRINTED(&child, "{\"event\":\"end\",\"failed\":1,");
+    CHECK_NOT_PRINTED(&child, "------");
+
+    _reset_output(&child);
+    CHECK_EQUAL(1, _run_child(&child, "Passing,Failing", none, NULL));
+    CHECK_EQUAL_STRING("", child.text);
+
+    /* Quiet runs print failures and the totals, and nothing when all pass */
+    _reset_output(&child);
+    CHECK_EQUAL(1, _run_child(&child, "Passing,Failing", quiet, NULL));
+    CHECK_PRINTED(&child, "error: Failing on purpose\n");
+    CHECK_PRINTED(&child, "1 failed, ");
+    CHECK_NOT_PRINTED(&child, "------");
+    CHECK_NOT_PRINTED(&child, "..");
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing", quiet, NULL));
+    CHECK_EQUAL_STRING("", child.text);
+
+    _reset_output(&child);
+    CHECK_NOT_EQUAL(0, _run_child(&child, "Passing", unknown, NULL));
+    CHECK_EQUAL_STRING("", child.text);
+    CHECK_NOT_NULL(strstr(_read_scratch(&child, "stderr"), "Unknown reporter xml"));
+    _remove_scratch(&child);
+}
+/* Dependency file for this file as the makefile writes it, with paths
+ * relative to the build directory
+ */
+static const char _runner_deps[] =
+    "test/unit_test_runner_test.o: test/unit_test_runner_test.c src/unit_test.h \\\n"
+    " src/widget.h\n"
+    "\n"
+    "src/unit_test.h:\n"
+    "\n"
+    "src/widget.h:\n";
+
+TEST(ChangedFiles)
+{
+    const char* header[] = {"--build-dir", ".", "--reporter", "json", "--changed", "src/widget.h", NULL};
+    const char* source[] = {"--build-dir", ".", "--reporter", "json", "--changed", "./src/../src/widget.c", NULL};
+    const char* other[] = {"--build-dir", ".", "--reporter", "json", "--changed", "src/gadget.c", NULL};
+    const char* list[] = {"--build-dir", ".", "--reporter", "json", "--changed-list", "changed.txt", NULL};
+    const char* lua[] = {"--build-dir", ".", "--reporter", "json", "--changed", "changed_test.lua", NULL};
+    const char* quiet[] = {"--build-dir", ".", "--quiet", "--changed", "src/widget.h", NULL};
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    _make_scratch_dir(&child, "test");
+    _write_scratch(&child, "test/unit_test_runner_test.d", _runner_deps, sizeof(_runner_deps)-1);
+    _write_scratch(&child, "changed_test.lua", "function Changed_Test() end\n", 28);
+
+    CHECK_EQUAL(0, _run_child(&child, "Passing", header, NULL));
+    CHECK_PRINTED(&child, "\"name\":\"Passing\"");
+    CHECK_PRINTED(&child, "for 1 changed files");
+    CHECK_NOT_PRINTED(&child, "Changed_Test");
+
+    /* A changed source file stands for the header with the same name */
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing", source, NULL));
+    CHECK_PRINTED(&child, "\"name\":\"Passing\"");
+
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing", other, NULL));
+    CHECK_NOT_PRINTED(&child, "\"name\":\"Passing\"");
+
+    _write_scratch(&child, "changed.txt", "README.md\r\n\nsrc/widget.h\r\n", 25);
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing", list, NULL));
+    CHECK_PRINTED(&child, "\"name\":\"Passing\"");
+    CHECK_PRINTED(&child, "for 2 changed files");
+
+    /* A quiet run that passes prints nothing, not even the selection */
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing", quiet, NULL));
+    CHECK_EQUAL_STRING("", child.text);
+
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing", lua, NULL));
+    CHECK_NOT_PRINTED(&child, "\"name\":\"Passing\"");
+#if LUA_TESTS
+    CHECK_PRINTED(&child, "\"name\":\"Changed_Test\"");
+#endif
+    _remove_scratch(&child);
+}
+/* Runs from a subdirectory of a git work tree, where paths from git and
+ * from the dependency file are relative to the top and not to the cwd
+ */
+TEST(ChangedInWorkTree)
+{
+    const char* root[] = {"--reporter", "json", "--changed", "src/widget.h", NULL};
+    const char* lua[] = {"--reporter", "json", "--changed", "test/changed_test.lua", NULL};
+    const char* since[] = {"--reporter", "json", "--changed-since", "HEAD", NULL};
+    const char* quoted[] = {"--changed-since", "\"; touch quoted; \"$(touch expanded)", NULL};
+    char command[256];
+    child_t child;
+    if(system("git --version > /dev/null 2>&1") != 0)
+        return; /* Nothing to test without git */
+    if(!_make_scratch(&child))
+        return;
+    _make_scratch_dir(&child, "src");
+    _make_scratch_dir(&child, "test");
+    _write_scratch(&child, "test/unit_test_runner_test.d", _runner_deps, sizeof(_runner_deps)-1);
+    _write_scratch(&child, "test/changed_test.lua", "function Changed_Test() end\n", 28);
+    _write_scratch(&child, "src/widget.h", "int widget;\n", 12);
+    sprintf(command, "cd %s && git init -q && git add -A && "
+            "git -c user.name=test -c user.email=test@example.com commit -qm base", child.dir);
+    CHECK_EQUAL(0, system(command));
+    child.cwd = "test";
+
+    CHECK_EQUAL(0, _run_child(&child, "Passing", root, NULL));
+    CHECK_PRINTED(&child, "\"name\":\"Passing\"");
+
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing", lua, NULL));
+    CHECK_NOT_PRINTED(&child, "\"name\":\"Passing\"");
+#if LUA_TESTS
+    CHECK_PRINTED(&child, "\"name\":\"Changed_Test\"");
+#endif
+
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing", since, NULL));
+    CHECK_PRINTED(&child, "for 0 changed files");
+    CHECK_NOT_PRINTED(&child, "\"name\":\"Passing\"");
+
+    _write_scratch(&child, "src/widget.h", "int widget, gadget;\n", 20);
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing", since, NULL));
+    CHECK_PRINTED(&child, "for 1 changed files");
+    CHECK_PRINTED(&child, "\"name\":\"Passing\"");
+
+    /* The ref goes to git as one argument, never through a shell */
+    _reset_output(&child);
+    CHECK_NOT_EQUAL(0, _run_child(&child, "Passing", quoted, NULL));
+    CHECK_NOT_NULL(strstr(_read_scratch(&child, "test/stderr"), "Could not list the files changed since"));
+    CHECK_NULL(_read_scratch(&child, "test/quoted"));
+    CHECK_NULL(_read_scratch(&child, "test/expanded"));
+    _remove_scratch(&child);
+}
+/* Rebuilding the binary restarts it with the same arguments */
+TEST(WatchRestart)
+{
+    const char* args[] = {"--watch", "--reporter", "json", NULL};
+    const char* self = _program_path(NULL);
+    char command[1200];
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    sprintf(command, "cp %s %s/watched", self, child.dir);
+    CHECK_EQUAL(0, system(command));
+    if(!_start_program(&child, _scratch_path(&child, "watched"), "Passing", args))
+        return;
+    CHECK_TRUE(_read_child(&child, "Watching ", CHILD_TIMEOUT_MS));
+    CHECK_PRINTED(&child, "\"name\":\"Passing\"");
+
+    /* Linkers write a new file and move it over the old one */
+    child.mark = child.size;
+    sprintf(command, "cp %s %s/watched.new && mv %s/watched.new %s/watched", self, child.dir, child.dir, child.dir);
+    CHECK_EQUAL(0, system(command));
+    CHECK_TRUE(_read_child(&child, "watched was rebuilt, restarting", CHILD_TIMEOUT_MS));
+    child.mark = child.size;
+    CHECK_TRUE(_read_child(&child, "Watching ", CHILD_TIMEOUT_MS));
+    CHECK_NOT_NULL(strstr(child.text + child.mark, "\"name\":\"Passing\""));
+#if LUA_TESTS
+    /* A Lua file written into the directory runs in the warm state */
+    child.mark = child.size;
+    _write_scratch(&child, "watched_test.lua", "function Watched_Test() end\n", 28);
+    CHECK_TRUE(_read_child(&child, "\"name\":\"Watched_Test\"", CHILD_TIMEOUT_MS));
+#endif
+    kill(child.pid, SIGKILL);
+    CHECK_EQUAL(-1, _finish_child(&child));
+    _remove_scratch(&child);
+}
+
+static int _fixture_wanted(const char* name)
+{
+    const char* list = getenv("UT_FIXTURES");
+    size_t length = strlen(name);
+    while(list && *list) {
+        if(strncmp(list, name, length) == 0 && (list[length] == ',' || list[length] == '\0'))
+            return 1;
+        list = strchr(list, ',');
+        if(list)
+            list++;
+    }
+    return 0;
+}
+TEST(Repeat)
+{
+    const char* repeat[] = {"--repeat", "20", "--seed", "1", NULL};
+    const char* until_fail[] = {"--repeat", "1000", "--until-fail", "--seed", "1", NULL};
+    const char* replay[] = {"--seed", NULL, NULL};
+    const char* found = NULL;
+    char expected[256];
+    char seed[16];
+    unsigned long failing_seed = 0;
+    int iteration = 0;
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    CHECK_EQUAL(0, _run_child(&child, "Passing", repeat, NULL));
+    CHECK_PRINTED(&child, "Repeating ");
+    CHECK_PRINTED(&child, " on 1 threads, seed 1\n");
+    CHECK_PRINTED(&child, "Passing (" __FILE__ "): 0/20 failed (0.00%)  mean ");
+
+    /* Every test stops at the first failure */
+    _reset_output(&child);
+    CHECK_EQUAL(1, _run_child(&child, "Passing,Flaky", until_fail, NULL));
+    CHECK_PRINTED(&child, "Passing (" __FILE__ "): 0/");
+    CHECK_NOT_PRINTED(&child, "0/1000 failed");
+    found = strstr(child.text, "first failure: iteration ");
+    CHECK_NOT_NULL(found);
+    if(found == NULL || sscanf(found, "first failure: iteration %d, seed %lu", &iteration, &failing_seed) != 2) {
+        FAIL("No first failure reported");
+        _remove_scratch(&child);
+        return;
+    }
+    sprintf(expected, "Flaky (%s): 1/%d failed", __FILE__, iteration);
+    CHECK_PRINTED(&child, expected);
+    sprintf(expected, ", at %s:%d\n", __FILE__, kFlakyLine);
+    CHECK_PRINTED(&child, expected);
+    CHECK_EQUAL(0, (int)(failing_seed % kFlakyPeriod));
+
+    /* The reported seed fails again on its own, the base seed passes */
+    _reset_output(&child);
+    sprintf(seed, "%lu", failing_seed);
+    replay[1] = seed;
+    CHECK_EQUAL(1, _run_child(&child, "Flaky", replay, NULL));
+    sprintf(expected, "%s(%d): error: ", __FILE__, kFlakyLine);
+    CHECK_PRINTED(&child, expected);
+    _reset_output(&child);
+    replay[1] = "1";
+    CHECK_EQUAL(0, _run_child(&child, "Flaky", replay, NULL));
+    _remove_scratch(&child);
+}
+TEST(AsyncTimeout)
+{
+    char expected[256];
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    CHECK_EQUAL(1, _run_child(&child, "Stalled", NULL, NULL));
+    sprintf(expected, "%s(%d): error: Stalled timed out after ", __FILE__, kStalledLine);
+    CHECK_PRINTED(&child, expected);
+    CHECK_PRINTED(&child, "ms without calling ut_done\n");
+    _remove_scratch(&child);
+}
+#if LUA_TESTS
+/* A Lua test past its set_timeout fails at the line of its function */
+static const char _lua_timeout_test[] =
+    "-- Fails on purpose\n"
+    "\n"
+    "function Timeout_Test()\n"
+    "\tut.set_timeout(10)\n"
+    "\tut.sleep(1000)\n"
+    "end\n";
+TEST(LuaTimeout)
+{
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    _write_scratch(&child, "timeout_test.lua", _lua_timeout_test, sizeof(_lua_timeout_test)-1);
+    CHECK_EQUAL(1, _run_child(&child, "Passing", NULL, NULL));
+    CHECK_PRINTED(&child, "/timeout_test.lua(3): error: Timeout_Test timed out after ");
+    _remove_scratch(&child);
+}
+#endif
+TEST(ArenaRewind)
+{
+    const char* poison[] = {"--poison-arena", NULL};
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    CHECK_EQUAL(0, _run_child(&child, "ArenaFill,ArenaReuse", poison, NULL));
+    CHECK_PRINTED(&child, "0 failed, ");
+
+    /* Without poisoning the rewound block still holds ArenaFill's bytes */
+    _reset_output(&child);
+    CHECK_EQUAL(1, _run_child(&child, "ArenaFill,ArenaReuse", NULL, NULL));
+    CHECK_PRINTED(&child, "error: Expected: 64  Actual: 0\n");
+    CHECK_PRINTED(&child, "1 failed, ");
+    _remove_scratch(&child);
+}
+TEST(ResourceBudgets)
+{
+    const char* usage[] = {"--usage", NULL};
+    const char* no_usage[] = {"--no-usage", NULL};
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    CHECK_EQUAL(1, _run_child(&child, "Passing,OverBudget", NULL, NULL));
+    CHECK_PRINTED(&child, "ms of CPU time, over the budget of 1ms\n");
+    CHECK_PRINTED(&child, "error: Resident set grew by ");
+    CHECK_PRINTED(&child, " bytes, over the budget of 1048576\n");
+    CHECK_NOT_PRINTED(&child, "Resource outliers:");
+
+    /* --usage lists the tests that stand out */
+    _reset_output(&child);
+    CHECK_EQUAL(1, _run_child(&child, "Passing,OverBudget", usage, NULL));
+    CHECK_PRINTED(&child, "Resource outliers:\n");
+    CHECK_PRINTED(&child, "  OverBudget: user cpu ");
+
+    /* --no-usage turns the budgets off as well */
+    _reset_output(&child);
+    CHECK_EQUAL(0, _run_child(&child, "Passing,OverBudget", no_usage, NULL));
+    CHECK_NOT_PRINTED(&child, "over the budget");
+    _remove_scratch(&child);
+}
+/* Connects to the driver socket once the child listens on it */
+static int _connect_driver(const char* path)
+{
+    uint64_t deadline = ut_now_ns() + (uint64_t)CHILD_TIMEOUT_MS * 1000000;
+    struct sockaddr_un address;
+    int fd;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    while(ut_now_ns() < deadline) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0)
+            break;
+        if(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0)
+            return fd;
+        close(fd);
+        poll(NULL, 0, 10);
+    }
+    FAIL("Could not connect to the driver");
+    return -1;
+}
+/* Sends a command over the socket and reads the answer into the child's
+ * output, up to text
+ */
+static int _driver_request(child_t* child, int fd, const char* command, const char* text)
+{
+    int output = child->output;
+    int answered;
+    CHECK_EQUAL((ssize_t)strlen(command), write(fd, command, strlen(command)));
+    child->output = fd;
+    answered = _read_child(child, text, CHILD_TIMEOUT_MS);
+    child->output = output;
+    return answered;
+}
+TEST(DriverStdin)
+{
+    const char* args[] = {"--driver", NULL};
+    const char* rest = "batch Passing Failing\nrun Nope\nfrob\nrun Chatty\nshutdown\nlist\n";
+    const char* found = NULL;
+    const char* shutdown = "{\"event\":\"shutdown\"}\n";
+    char expected[256];
+    char* errors = NULL;
+    int id;
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    if(!_start_child(&child, "Passing,Failing,Chatty", args))
+        return;
+    CHECK_EQUAL(5, (int)write(child.input, "list\n", 5));
+    CHECK_TRUE(_read_child(&child, "{\"event\":\"end\",\"total\":", CHILD_TIMEOUT_MS));
+    found = strstr(child.text, ",\"name\":\"Passing\",\"file\":");
+    CHECK_NOT_NULL(found);
+    if(found == NULL) {
+        kill(child.pid, SIGKILL);
+        _finish_child(&child);
+        _remove_scratch(&child);
+        return;
+    }
+    CHECK_PRINTED(&child, "\"kind\":\"c\"}\n");
+    while(found > child.text && found[-1] != ':')
+        --found;
+    id = atoi(found);
+
+    /* Tests run by id or name, one connection, many commands */
+    child.mark = child.size;
+    sprintf(expected, "run %d\n", id);
+    CHECK_EQUAL((ssize_t)strlen(expected), write(child.input, expected, strlen(expected)));
+    CHECK_TRUE(_read_child(&child, "{\"event\":\"end\",", CHILD_TIMEOUT_MS));
+    sprintf(expected, "{\"event\":\"begin\"}\n{\"event\":\"start\",\"id\":%d,\"name\":\"Passing\"}\n"
+            "{\"event\":\"test\",\"name\":\"Passing\",\"status\":\"pass\",", id);
+    CHECK_EQUAL(0, strncmp(child.text + child.mark, expected, strlen(expected)));
+    CHECK_EQUAL((ssize_t)strlen(rest), write(child.input, rest, strlen(rest)));
+    CHECK_EQUAL(1, _finish_child(&child));
+
+    CHECK_PRINTED(&child, "{\"event\":\"failure\",\"name\":\"Failing\",");
+    CHECK_PRINTED(&child, "{\"event\":\"end\",\"failed\":1,\"passed\":1,");
+    CHECK_PRINTED(&child, "{\"event\":\"error\",\"message\":\"unknown test\",\"subject\":\"Nope\"}\n");
+    CHECK_PRINTED(&child, "{\"event\":\"error\",\"message\":\"unknown command\",\"subject\":\"frob\"}\n");
+    CHECK_PRINTED(&child, "\"name\":\"Chatty\",\"status\":\"pass\"");
+    /* Nothing is answered after shutdown, and tests print to stderr */
+    CHECK_TRUE(child.size >= strlen(shutdown));
+    CHECK_EQUAL_STRING(shutdown, child.text + child.size - strlen(shutdown));
+    CHECK_NOT_PRINTED(&child, "Chatty output");
+    errors = _read_scratch(&child, "stderr");
+    CHECK_NOT_NULL(errors);
+    CHECK_NOT_NULL(errors ? strstr(errors, "Chatty output\n") : NULL);
+    _remove_scratch(&child);
+}
+TEST(DriverSocket)
+{
+    const char* args[] = {"--driver-socket", NULL, NULL};
+    char path[64];
+    int fd;
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    strcpy(path, _scratch_path(&child, "driver.sock"));
+    args[1] = path;
+    if(!_start_child(&child, "Passing,Failing", args))
+        return;
+
+    /* The scheduler may hang up and connect again */
+    fd = _connect_driver(path);
+    if(fd >= 0) {
+        CHECK_TRUE(_driver_request(&child, fd, "run Failing\n", "{\"event\":\"end\","));
+        CHECK_PRINTED(&child, "\"message\":\"Failing on purpose\"}\n");
+        CHECK_PRINTED(&child, "{\"event\":\"end\",\"failed\":1,");
+        close(fd);
+    }
+    child.mark = child.size;
+    fd = _connect_driver(path);
+    if(fd >= 0) {
+        CHECK_TRUE(_driver_request(&child, fd, "list\n", "{\"event\":\"end\",\"total\":"));
+        CHECK_PRINTED(&child, "\"name\":\"Passing\"");
+        CHECK_TRUE(_driver_request(&child, fd, "shutdown\n", "{\"event\":\"shutdown\"}\n"));
+        close(fd);
+    }
+    CHECK_EQUAL(1, _finish_child(&child));
+    CHECK_EQUAL(-1, access(path, F_OK));
+    _remove_scratch(&child);
+}
+TEST(ThreadChecks)
+{
+    const char* json[] = {"--reporter", "json", NULL};
+    const char* repeat[] = {"--repeat", "3", NULL};
+    const char* parallel[] = {"--repeat", "3", "--jobs", "2", NULL};
+    char expected[256];
+    child_t child;
+    if(!_make_scratch(&child))
+        return;
+    CHECK_EQUAL(2, _run_child(&child, "Passing,ThreadFailure,AsyncThreadFailure", json, NULL));
+    CHECK_PRINTED(&child, "{\"event\":\"failure\",\"name\":\"ThreadFailure\",");
+    CHECK_PRINTED(&child, "{\"event\":\"test\",\"name\":\"ThreadFailure\",\"status\":\"fail\",");
+    CHECK_PRINTED(&child, "{\"event\":\"test\",\"name\":\"AsyncThreadFailure\",\"status\":\"fail\",");
+    CHECK_PRINTED(&child, "{\"event\":\"test\",\"name\":\"Passing\",\"status\":\"pass\",");
+
+    _reset_output(&child);
+    CHECK_EQUAL(2, _run_child(&child, "ThreadFailure,AsyncThreadFailure", repeat, NULL));
+    sprintf(expected, "ThreadFailure (%s): 3/3 failed", __FILE__);
+    CHECK_PRINTED(&child, expected);
+    sprintf(expected, "AsyncThreadFailure (%s): 3/3 failed", __FILE__);
+    CHECK_PRINTED(&child, expected);
+
+    /* In parallel the failures cannot be pinned on a test, but still count */
+    _reset_output(&child);
+    CHECK_EQUAL(1, _run_child(&child, "ThreadFailure", parallel, NULL));
+    CHECK_PRINTED(&child, "checks failed on threads the tests started themselves, which --jobs 2 ");
+    _remove_scratch(&child);
+}
+
+#endif /* __linux__ */
+
+TEST_MODULE(unit_test_runner)
+{
+#ifdef __linux__
+    REGISTER_TEST(SnapshotFailures);
+    REGISTER_TEST(SnapshotUpdate);
+    REGISTER_TEST(JournalRoundTrip);
+    REGISTER_TEST(Reporters);
+    REGISTER_TEST(ChangedFiles);
+    REGISTER_TEST(ChangedInWorkTree);
+    REGISTER_TEST(WatchRestart);
+    REGISTER_TEST(Repeat);
+    REGISTER_TEST(AsyncTimeout);
+#if LUA_TESTS
+    REGISTER_TEST(LuaTimeout);
+#endif
+    REGISTER_TEST(ArenaRewind);
+    REGISTER_TEST(ResourceBudgets);
+    REGISTER_TEST(DriverStdin);
+    REGISTER_TEST(DriverSocket);
+    REGISTER_TEST(ThreadChecks);
+#endif
+}
+
+TEST_MODULE(unit_test_fixtures)
+{
+#ifdef __linux__
+    if(_fixture_wanted("Snapshots"))
+        REGISTER_TEST(Snapshots);
+    if(_fixture_wanted("Passing"))
+        REGISTER_TEST(Passing);
+    if(_fixture_wanted("Failing"))
+        REGISTER_TEST(Failing);
+    if(_fixture_wanted("Flaky"))
+        REGISTER_TEST(Flaky);
+    if(_fixture_wanted("ArenaFill"))
+        REGISTER_TEST(ArenaFill);
+    if(_fixture_wanted("ArenaReuse"))
+        REGISTER_TEST(ArenaReuse);
+    if(_fixture_wanted("OverBudget"))
+        REGISTER_TEST(OverBudget);
+    if(_fixture_wanted("Chatty"))
+        REGISTER_TEST(Chatty);
+    if(_fixture_wanted("ThreadFailure"))
+        REGISTER_TEST(ThreadFailure);
+    if(_fixture_wanted("AsyncThreadFailure"))
+        REGISTER_ASYNC_TEST(AsyncThreadFailure);
+    if(_fixture_wanted("Stalled"))
+        REGISTER_ASYNC_TEST(Stalled);
+#endif
+}
@@ -1,9 +1,16 @@
 /** @file unit_test_test.cpp
  *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
  */
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+    #define _XOPEN_SOURCE 700 /* pipe under -std=c89 */
+#endif
 #include "unit_test.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
 
 TEST(MakeTest)
 {
@@ -64,7 +71,149 @@ TEST(CheckString)
     const char* c = "Goodbye world";
     CHECK_EQUAL_STRING(a, b);
     CHECK_NOT_EQUAL_STRING(a, c);
+    CHECK_EQUAL_STRING(NULL, NULL);
+    CHECK_NOT_EQUAL_STRING(a, NULL);
 }
+TEST(CheckSnapshot)
+{
+    const char golden[] = "line one\nline two\nline three\n";
+    char path[64];
+    FILE* file = NULL;
+    /* One file per iteration; --repeat --jobs may run several at once */
+    sprintf(path, "unit_test_snapshot_%lu.golden", (unsigned long)ut_seed());
+    file = fopen(path, "wb");
+    CHECK_NOT_NULL(file);
+    if(file == NULL)
+        return;
+    fwrite(golden, 1, sizeof(golden)-1, file);
+    fclose(file);
+
+    CHECK_MATCHES_SNAPSHOT(path, golden, sizeof(golden)-1);
+    remove(path);
+}
+
+enum { kStressThreads = 4, kStressRounds = 200 };
+static void _stress_body(void* data, int thread_index, int round)
+{
+    int* counts = (int*)data;
+    CHECK_EQUAL(round, counts[thread_index]);
+    ut_stress_yield();
+    counts[thread_index]++;
+}
+TEST(StressChecks)
+{
+    int counts[kStressThreads] = {0};
+    int ii;
+    ut_stress(kStressThreads, kStressRounds, &_stress_body, counts, UT_STRESS_RANDOM_YIELD);
+    for(ii=0; ii<kStressThreads; ++ii)
+        CHECK_EQUAL(kStressRounds, counts[ii]);
+}
+
+TEST(Histogram)
+{
+    /* Heap rather than statics so concurrent iterations stay apart */
+    ut_histogram_t* low = (ut_histogram_t*)malloc(sizeof(ut_histogram_t));
+    ut_histogram_t* high = (ut_histogram_t*)malloc(sizeof(ut_histogram_t));
+    uint64_t ii;
+    CHECK_NOT_NULL(low);
+    CHECK_NOT_NULL(high);
+    if(low && high) {
+        ut_hist_reset(low);
+        ut_hist_reset(high);
+        for(ii=1; ii<=500; ++ii) {
+            UT_HIST_RECORD(low, ii*100);
+            UT_HIST_RECORD(high, (ii+500)*100);
+        }
+        ut_hist_merge(low, high);
+        CHECK_EQUAL(1000, low->count);
+        CHECK_EQUAL(100, ut_hist_percentile(low, 0.0));
+        CHECK_EQUAL(100000, ut_hist_percentile(low, 100.0));
+        CHECK_EQUAL_FLOAT_EPSILON(50000.0, (double)ut_hist_percentile(low, 50.0), 500.0);
+        CHECK_PERCENTILE_BELOW(low, 99.0, 101000);
+        CHECK_PERCENTILE_BELOW(low, 99.9, 101000);
+    }
+    free(low);
+    free(high);
+}
+
+TEST(ResourceBudget)
+{
+    char* buffer;
+    CHECK_MAX_RSS_GROWTH(64*1024*1024);
+    CHECK_MAX_CPU_MS(10000);
+    buffer = (char*)ut_alloc(1024*1024);
+    memset(buffer, 1, 1024*1024);
+}
+
+TEST(Arena)
+{
+    int* small = (int*)ut_alloc(sizeof(int) * 4);
+    char* aligned = (char*)ut_alloc_aligned(100, 64);
+    char* large = (char*)ut_alloc(1024*1024);
+    char* copy = ut_strdup("arena");
+    CHECK_NOT_NULL(small);
+    CHECK_EQUAL(0, (int)((uintptr_t)small % 16));
+    CHECK_NOT_NULL(aligned);
+    CHECK_EQUAL(0, (int)((uintptr_t)aligned % 64));
+    CHECK_NOT_NULL(large);
+    memset(large, 1, 1024*1024);
+    CHECK_EQUAL(1, large[1024*1024-1]);
+    CHECK_EQUAL_STRING("arena", copy);
+    CHECK_NOT_EQUAL_POINTER(small, copy);
+}
+
+static void _async_timer_fired(ut_async_t* test, void* data)
+{
+    uint64_t* start = (uint64_t*)data;
+    CHECK_GREATER_THAN_EQUAL((int64_t)(ut_now_ns() - *start), 5000000);
+    free(start);
+    ut_done(test);
+}
+ASYNC_TEST(AsyncTimer)
+{
+    uint64_t* start = (uint64_t*)malloc(sizeof(uint64_t));
+    CHECK_NOT_NULL(start);
+    if(start == NULL) {
+        ut_done(test);
+        return;
+    }
+    *start = ut_now_ns();
+    ut_after(test, 5, &_async_timer_fired, start);
+}
+
+#ifndef _WIN32
+static void _async_pipe_readable(ut_async_t* test, int fd, int events, void* data)
+{
+    int* fds = (int*)data;
+    char c = 0;
+    CHECK_EQUAL(UT_READABLE, events);
+    CHECK_EQUAL(1, read(fd, &c, 1));
+    CHECK_EQUAL('x', c);
+    ut_unwatch_fd(test, fd);
+    close(fds[0]);
+    close(fds[1]);
+    free(fds);
+    ut_done(test);
+}
+static void _async_pipe_write(ut_async_t* test, void* data)
+{
+    int* fds = (int*)data;
+    CHECK_EQUAL(1, write(fds[1], "x", 1));
+    (void)sizeof(test);
+}
+ASYNC_TEST(AsyncPipe)
+{
+    int* fds = (int*)malloc(sizeof(int) * 2);
+    CHECK_NOT_NULL(fds);
+    if(fds == NULL) {
+        ut_done(test);
+        return;
+    }
+    CHECK_EQUAL(0, pipe(fds));
+    CHECK_EQUAL(0, ut_watch_fd(test, fds[0], UT_READABLE, &_async_pipe_readable, fds));
+    ut_after(test, 1, &_async_pipe_write, fds);
+}
+#endif
 
 
 TEST_MODULE(unit_test)
@@ -78,4 +227,13 @@ TEST_MODULE(unit_test)
     REGISTER_TEST(CheckFloatEqual);
     REGISTER_TEST(CheckFloatLTGT);
     REGISTER_TEST(CheckString);
+    REGISTER_TEST(CheckSnapshot);
+    REGISTER_TEST(StressChecks);
+    REGISTER_TEST(Histogram);
+    REGISTER_TEST(ResourceBudget);
+    REGISTER_TEST(Arena);
+    REGISTER_ASYNC_TEST(AsyncTimer);
+#ifndef _WIN32
+    REGISTER_ASYNC_TEST(AsyncPipe);
+#endif
 }
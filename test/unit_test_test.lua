@@ -24,3 +24,70 @@ function BasicCheck_Test()
 	CHECK_NOT_EQUAL_STRING("This is a string", "This is a string too")
 end
 
+
+ticks = 0
+ticking = false
+
+function Sleep_Test()
+	local start = ut.now()
+	local ticks_before = ticks
+	ut.sleep(20)
+	CHECK_GREATER_THAN_EQUAL_FLOAT(ut.now() - start, 20)
+	-- The ticker runs alongside unless --repeat runs the tests one at a time
+	if ticking then
+		CHECK_GREATER_THAN(ticks, ticks_before)
+	end
+end
+
+function Sleep_Ticker_Test()
+	ticking = true
+	for i = 1, 50 do
+		ticks = ticks + 1
+		ut.sleep(1)
+	end
+	ticking = false
+end
+
+function Future_Test()
+	local value = ut.future()
+	value:resolve(42)
+	CHECK_EQUAL(42, ut.await(value))
+end
+
+answer = ut.future()
+resolving = false
+
+function Future_Await_Test()
+	local start = ut.now()
+	-- Let the resolver start; under --repeat it never does
+	ut.sleep(0)
+	if not resolving then
+		answer:resolve(42)
+	end
+	CHECK_EQUAL(42, ut.await(answer))
+	if resolving then
+		CHECK_GREATER_THAN_EQUAL_FLOAT(ut.now() - start, 5)
+	end
+end
+
+function Future_Resolve_Test()
+	resolving = true
+	ut.sleep(5)
+	answer:resolve(42)
+	resolving = false
+end
+
+function Wait_Fd_Test()
+	if package.config:sub(1, 1) == "\\" then
+		return
+	end
+	local reader = io.popen("sleep 0.02; echo ready")
+	local writer = io.popen("cat > /dev/null", "w")
+	local start = ut.now()
+	CHECK_TRUE(ut.wait_readable(reader))
+	CHECK_GREATER_THAN_EQUAL_FLOAT(ut.now() - start, 10)
+	CHECK_EQUAL_STRING("ready", reader:read("*l"))
+	CHECK_TRUE(ut.wait_writable(writer))
+	reader:close()
+	writer:close()
+end
@@ -0,0 +1,191 @@
+/** @file ut_journal.c
+ *  @brief Converts a results journal written by --journal to JSON, JUnit XML
+ *      or TAP. The journal may still be in use by a running test binary.
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#include "unit_test_journal.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    kFormatJSON,
+    kFormatJUnit,
+    kFormatTAP
+} format_t;
+
+/* Internal functions
+ */
+static const char* _status_name(uint32_t status)
+{
+    switch(status)
+    {
+    case kJournalRunning: return "running";
+    case kJournalPass: return "pass";
+    case kJournalFail: return "fail";
+    case kJournalIgnore: return "ignore";
+    }
+    return "unknown";
+}
+static void _print_escaped(const char* str, size_t size, int xml)
+{
+    size_t ii;
+    for(ii=0; ii<size && str[ii]; ++ii) {
+        unsigned char c = (unsigned char)str[ii];
+        if(xml) {
+            switch(c)
+            {
+            case '<': printf("&lt;"); break;
+            case '>': printf("&gt;"); break;
+            case '&': printf("&amp;"); break;
+            case '"': printf("&quot;"); break;
+            default: putchar(c); break;
+            }
+        } else if(c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if(c < 0x20) {
+            printf("\\u%04x", (unsigned int)c);
+        } else {
+            putchar(c);
+        }
+    }
+}
+static void _print_json(const ut_journal_header_t* header, const ut_journal_record_t* records)
+{
+    uint32_t ii;
+    printf("{\"pid\":%u,\"start_time\":%"PRIu64",\"finished\":%s,",
+           (unsigned int)header->pid, header->start_time, header->finished ? "true" : "false");
+    printf("\"failed\":%u,\"passed\":%u,\"ignored\":%u,\"tests\":[",
+           (unsigned int)header->num_failed, (unsigned int)header->num_passed, (unsigned int)header->num_ignored);
+    for(ii=0; ii<header->count; ++ii) {
+        const ut_journal_record_t* record = records + ii;
+        printf("%s\n{\"id\":%u,\"name\":\"", ii ? "," : "", (unsigned int)record->id);
+        _print_escaped(record->name, sizeof(record->name), 0);
+        printf("\",\"status\":\"%s\",\"duration_ns\":%"PRIu64, _status_name(record->status), record->duration_ns);
+        if(record->file[0]) {
+            printf(",\"file\":\"");
+            _print_escaped(record->file, sizeof(record->file), 0);
+            printf("\",\"line\":%d", (int)record->line);
+        }
+        printf("}");
+    }
+    printf("\n]}\n");
+}
+static void _print_junit(const ut_journal_header_t* header, const ut_journal_record_t* records)
+{
+    uint32_t failures = 0;
+    uint32_t errors = 0;
+    uint32_t skipped = 0;
+    uint64_t total_ns = 0;
+    uint32_t ii;
+    for(ii=0; ii<header->count; ++ii) {
+        failures += records[ii].status == kJournalFail;
+        errors += records[ii].status == kJournalRunning;
+        skipped += records[ii].status == kJournalIgnore;
+        total_ns += records[ii].duration_ns;
+    }
+    printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    printf("<testsuite name=\"unit_test\" tests=\"%u\" failures=\"%u\" errors=\"%u\" skipped=\"%u\" time=\"%.6f\">\n",
+           (unsigned int)header->count, (unsigned int)failures, (unsigned int)errors,
+           (unsigned int)skipped, (double)total_ns / 1e9);
+    for(ii=0; ii<header->count; ++ii) {
+        const ut_journal_record_t* record = records + ii;
+        printf("  <testcase name=\"");
+        _print_escaped(record->name, sizeof(record->name), 1);
+        printf("\" time=\"%.6f\"", (double)record->duration_ns / 1e9);
+        switch(record->status)
+        {
+        case kJournalFail:
+            printf(">\n    <failure message=\"");
+            _print_escaped(record->file, sizeof(record->file), 1);
+            printf(":%d\"/>\n  </testcase>\n", (int)record->line);
+            break;
+        case kJournalRunning:
+            printf(">\n    <error message=\"did not finish\"/>\n  </testcase>\n");
+            break;
+        case kJournalIgnore:
+            printf(">\n    <skipped/>\n  </testcase>\n");
+            break;
+        default:
+            printf("/>\n");
+            break;
+        }
+    }
+    printf("</testsuite>\n");
+}
+static void _print_tap(const ut_journal_header_t* header, const ut_journal_record_t* records)
+{
+    uint32_t ii;
+    printf("TAP version 13\n1..%u\n", (unsigned int)header->count);
+    for(ii=0; ii<header->count; ++ii) {
+        const ut_journal_record_t* record = records + ii;
+        int ok = record->status == kJournalPass || record->status == kJournalIgnore;
+        printf("%s %u - ", ok ? "ok" : "not ok", (unsigned int)ii+1);
+        _print_escaped(record->name, sizeof(record->name), 0);
+        if(record->status == kJournalIgnore)
+            printf(" # SKIP");
+        printf("\n");
+        if(record->status == kJournalFail)
+            printf("  # %.*s:%d\n", (int)sizeof(record->file), record->file, (int)record->line);
+        else if(record->status == kJournalRunning)
+            printf("  # did not finish\n");
+    }
+}
+
+/* External functions
+ */
+int main(int argc, const char* argv[])
+{
+    format_t format = kFormatJSON;
+    const char* path = NULL;
+    ut_journal_header_t header;
+    ut_journal_record_t* records = NULL;
+    FILE* file = NULL;
+    int ii;
+
+    for(ii=1; ii<argc; ++ii) {
+        if(strcmp(argv[ii], "--json") == 0)
+            format = kFormatJSON;
+        else if(strcmp(argv[ii], "--junit") == 0)
+            format = kFormatJUnit;
+        else if(strcmp(argv[ii], "--tap") == 0)
+            format = kFormatTAP;
+        else
+            path = argv[ii];
+    }
+    if(path == NULL) {
+        fprintf(stderr, "usage: %s [--json | --junit | --tap] journal\n", argv[0]);
+        return 2;
+    }
+
+    file = fopen(path, "rb");
+    if(file == NULL) {
+        perror(path);
+        return 1;
+    }
+    if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != UT_JOURNAL_MAGIC ||
+       header.version != UT_JOURNAL_VERSION || header.record_size != sizeof(ut_journal_record_t)) {
+        fprintf(stderr, "%s: not a unit test journal\n", path);
+        fclose(file);
+        return 1;
+    }
+    /* The writer may append while we read; only take complete records */
+    records = (ut_journal_record_t*)calloc(header.count ? header.count : 1, sizeof(*records));
+    if(records == NULL) {
+        fclose(file);
+        return 1;
+    }
+    fseek(file, (long)header.header_size, SEEK_SET);
+    header.count = (uint32_t)fread(records, sizeof(*records), header.count, file);
+    fclose(file);
+
+    switch(format)
+    {
+    case kFormatJSON: _print_json(&header, records); break;
+    case kFormatJUnit: _print_junit(&header, records); break;
+    case kFormatTAP: _print_tap(&header, records); break;
+    }
+    free(records);
+    return 0;
+}